@@ -1,6 +1,10 @@
 #include "spdf.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 // utils.c
@@ -159,6 +163,7 @@ void print_spdf(spdf_t *doc) {
   printf("  ⏲️ %ld\n", doc->updated);
   printf("  🔗 %zu\n", doc->xref_offset);
   printf("  💦 %zu\n", doc->n_streams - 2);
+  printf("  📦 %zu\n", doc->n_blocks);
   for (size_t i = 2; i < doc->max_streams; i++) {
     if (doc->streams[i] && *doc->streams[i]->id) {
       if (doc->streams[i]->mime_type == TEXT && doc->streams[i]->data) {
@@ -172,11 +177,61 @@ void print_spdf(spdf_t *doc) {
   puts("");
 }
 
-bool add_stream(spdf_stream_t *stream, spdf_t *doc) {
+static uint64_t wal_log_add(spdf_wal_t *wal, const spdf_stream_t *stream);
+static uint64_t wal_log_remove(spdf_wal_t *wal, const char *id);
+
+static bool is_saved(const spdf_stream_t *stream) {
+  return stream && *stream->id;
+}
+
+// Returns max_streams when no live stream has this id.
+static size_t find_slot(spdf_t *doc, const char *id) {
+  size_t i = 0;
+  for (; i < doc->max_streams; i++)
+    if (is_saved(doc->streams[i]) &&
+        !strncmp(doc->streams[i]->id, id, ID_LEN))
+      break;
+  return i;
+}
+
+// Turns slot i into a removed placeholder; the caller frees its data.
+static void clear_slot(spdf_t *doc, size_t i) {
+  spdf_stream_t *stream = doc->streams[i];
+  doc->xref_offset -= sizeof(spdf_stream_t) + stream->data_size;
+
+  if (doc->cache)
+    spdf_cache_invalidate(doc->cache, stream->id);
+  if (doc->index)
+    index_remove_stream(doc->index, stream, i);
+
+  memset(stream, 0, sizeof(spdf_stream_t));
+  stream->stream_type = METADATA_STREAM;
+  strncpy(stream->version, VERSION, VERSION_LEN);
+  doc->n_streams--;
+  doc->updated = time(NULL);
+}
+
+// Puts a stream cleared by clear_slot back into its placeholder.
+static void restore_slot(spdf_t *doc, size_t i, const spdf_stream_t *saved) {
+  *doc->streams[i] = *saved;
+  doc->xref_offset += sizeof(spdf_stream_t) + saved->data_size;
+  if (doc->index)
+    index_add_stream(doc->index, doc->streams[i], i);
+  doc->n_streams++;
+  doc->updated = time(NULL);
+}
+
+/*
+ * With a WAL attached, the call returns once the mutation is durable. If the
+ * log cannot be synced, the stream is taken out again and false returned.
+ */
+static bool insert_stream(spdf_stream_t *stream, spdf_t *doc, bool assign_id) {
   if (stream->stream_type == DATA_STREAM)
     printf("+ 💧 %p", stream);
 
+  pthread_mutex_lock(doc->lock);
   if (doc->n_streams >= doc->max_streams) {
+    pthread_mutex_unlock(doc->lock);
     if (stream) {
       if (stream->data)
         free(stream->data);
@@ -184,30 +239,63 @@ bool add_stream(spdf_stream_t *stream, spdf_t *doc) {
     }
     return false;
   }
-
-  pthread_mutex_lock(doc->lock);
   printf(" 🔒");
 
-  if (stream->stream_type == DATA_STREAM) {
+  if (assign_id && stream->stream_type == DATA_STREAM) {
     char *tmp_id = generate_id();
     if (tmp_id)
       strncpy(stream->id, tmp_id, ID_LEN);
     free(tmp_id);
   }
 
-  doc->xref_offset += sizeof(spdf_stream_t) + stream->data_size;
-
   size_t i = 0;
   for (; i < doc->max_streams; i++)
     if (!doc->streams[i])
       break;
 
+  if (i == doc->max_streams ||
+      (doc->index && !index_add_stream(doc->index, stream, i))) {
+    pthread_mutex_unlock(doc->lock);
+    free(stream->data);
+    free(stream);
+    return false;
+  }
+
+  spdf_wal_t *wal = doc->wal;
+  uint64_t lsn = 0;
+  if (wal && !(lsn = wal_log_add(wal, stream))) {
+    if (doc->index)
+      index_remove_stream(doc->index, stream, i);
+    pthread_mutex_unlock(doc->lock);
+    free(stream->data);
+    free(stream);
+    return false;
+  }
+
+  doc->xref_offset += sizeof(spdf_stream_t) + stream->data_size;
   doc->streams[i] = stream;
   doc->n_streams++;
   doc->updated = time(NULL);
   pthread_mutex_unlock(doc->lock);
   printf(" 🔓 ✔️ %s\n", (char*)stream->data);
-  return true;
+
+  // Wait outside the document lock so concurrent adds share one sync
+  if (!lsn || sync_spdf_wal(wal, lsn))
+    return true;
+
+  // The failed log refuses every later record, so nothing can depend on it
+  pthread_mutex_lock(doc->lock);
+  if (doc->streams[i] == stream && *stream->id) {
+    void *data = stream->data;
+    clear_slot(doc, i);
+    free(data);
+  }
+  pthread_mutex_unlock(doc->lock);
+  return false;
+}
+
+bool add_stream(spdf_stream_t *stream, spdf_t *doc) {
+  return insert_stream(stream, doc, true);
 }
 
 bool remove_stream(spdf_stream_t *stream, spdf_t *doc) {
@@ -224,27 +312,34 @@ bool remove_stream(spdf_stream_t *stream, spdf_t *doc) {
   char tmp[ID_LEN];
   strncpy(tmp, stream->id, ID_LEN);
 
-  for (size_t i = 2; i < doc->max_streams; i++) {
-    if (!*doc->streams[i]->id)
-      continue;
+  // Slots 0 and 1 hold the metadata and footer streams
+  size_t i = find_slot(doc, tmp);
+  if (i < 2 || i == doc->max_streams) {
+    pthread_mutex_unlock(doc->lock);
+    return false;
+  }
 
-    if (strcmp(doc->streams[i]->id, stream->id))
-      continue;
+  spdf_wal_t *wal = doc->wal;
+  uint64_t lsn = 0;
+  if (wal && !(lsn = wal_log_remove(wal, doc->streams[i]->id))) {
+    pthread_mutex_unlock(doc->lock);
+    return false;
+  }
 
-    doc->xref_offset -= sizeof(spdf_stream_t) + stream->data_size;
+  // The data is only freed once the removal is durable
+  spdf_stream_t saved = *doc->streams[i];
+  clear_slot(doc, i);
+  pthread_mutex_unlock(doc->lock);
+  printf(" 🔓 ✔️ %s\n", tmp);
 
-    free(doc->streams[i]->data);
-    doc->streams[i]->data_size = 0;
-    memset(doc->streams[i], 0, sizeof(spdf_stream_t));
-    doc->streams[i]->stream_type = METADATA_STREAM;
-    strncpy(doc->streams[i]->version, VERSION, VERSION_LEN);
-    doc->n_streams--;
-    doc->updated = time(NULL);
-    pthread_mutex_unlock(doc->lock);
-    printf(" 🔓 ✔️ %s\n", tmp);
+  if (!lsn || sync_spdf_wal(wal, lsn)) {
+    free(saved.data);
     return true;
   }
 
+  // Placeholders are never reused, so slot i is still free to restore
+  pthread_mutex_lock(doc->lock);
+  restore_slot(doc, i, &saved);
   pthread_mutex_unlock(doc->lock);
   return false;
 }
@@ -288,6 +383,15 @@ spdf_t *create_spdf(size_t max_elements) {
     free(doc);
     return NULL;
   }
+
+  doc->index = create_spdf_index(doc->max_streams);
+  if (!doc->index) {
+    free(doc->streams);
+    pthread_mutex_destroy(doc->lock);
+    free(doc->lock);
+    free(doc);
+    return NULL;
+  }
   printf("+ 🗂 💧");
   add_stream(create_default_metadata_stream(), doc);
   printf("+ 🔗 💧");
@@ -299,6 +403,8 @@ spdf_t *create_spdf(size_t max_elements) {
 }
 
 bool destroy_spdf(spdf_t *doc) {
+  if (doc->wal)
+    close_spdf_wal(doc);
 
   for (size_t i = 0; i < doc->max_streams; i++) {
     if (doc->streams[i]) {
@@ -311,6 +417,16 @@ bool destroy_spdf(spdf_t *doc) {
   if (doc->streams)
     free(doc->streams);
 
+  if (doc->cache)
+    destroy_spdf_cache(doc->cache);
+
+  if (doc->index)
+    destroy_spdf_index(doc->index);
+
+  for (size_t i = 0; i < doc->n_blocks; i++)
+    destroy_spdf_block(doc->blocks[i]);
+  free(doc->blocks);
+
   if (doc->lock) {
     pthread_mutex_destroy(doc->lock);
     free(doc->lock);
@@ -321,9 +437,20 @@ bool destroy_spdf(spdf_t *doc) {
   return true;
 }
 
-bool save_spdf(const spdf_t *document, FILE *out) { 
+// Removed streams stay in their slot as blank placeholders without an id.
+// Slot numbers only survive a save when no placeholder precedes a stream.
+static bool slots_preserved(const spdf_t *document) {
+  for (size_t i = 0; i < document->n_streams; ++i)
+    if (!is_saved(document->streams[i]))
+      return false;
+  return true;
+}
+
+static bool save_spdf_header(const spdf_t *document, FILE *out) {
   // write magic number 
-  fwrite("%%SPDF", 6, 1, out);
+  errno = 0;
+  if (fwrite("%%SPDF", 6, 1, out) < 1 || errno)
+    return false;
 
   // write metadata stream
   WRITE_AND_CHECK(document, version, out);
@@ -333,22 +460,256 @@ bool save_spdf(const spdf_t *document, FILE *out) {
   WRITE_AND_CHECK(document, xref_offset, out);
   WRITE_AND_CHECK(document, n_streams, out);
 
-  // write data streams
-  for (size_t i = 0; i < document->n_streams; ++i)    
-    serialize_spdf_stream_t(document->streams[i], out);  
+  return true;
+}
+
+static bool save_spdf_trailer(const spdf_t *document, FILE *out) {
+  // write packed stream blocks
+  if (!save_spdf_blocks(document, out))
+    return false;
 
   // write xref stream
+  uint8_t has_index = document->persist_index && document->index;
+  errno = 0;
+  if (fwrite(&has_index, sizeof(has_index), 1, out) < 1 || errno)
+    return false;
+  if (has_index) {
+    if (slots_preserved(document)) {
+      if (!save_spdf_index(document->index, out))
+        return false;
+    } else {
+      spdf_index_t *compacted = compact_spdf_index(document);
+      bool ok = compacted && save_spdf_index(compacted, out);
+      destroy_spdf_index(compacted);
+      if (!ok)
+        return false;
+    }
+  }
 
   // write xref offset
   WRITE_AND_CHECK(document, xref_offset, out);
 
   // write eof
-  fwrite("EOF%%", 5, 1, out);
+  errno = 0;
+  if (fwrite("EOF%%", 5, 1, out) < 1 || errno)
+    return false;
+
+  return true;
+}
+
+// Writes every live slot in order; the header promised n_streams of them.
+static bool save_streams(const spdf_t *document, FILE *out) {
+  size_t n_saved = 0;
+  for (size_t i = 0; i < document->max_streams; ++i) {
+    if (!is_saved(document->streams[i]))
+      continue;
+    if (!serialize_spdf_stream_t(document->streams[i], out))
+      return false;
+    n_saved++;
+  }
+  return n_saved == document->n_streams;
+}
+
+bool save_spdf(const spdf_t *document, FILE *out) { 
+  if (!save_spdf_header(document, out))
+    return false;
+
+  // write data streams
+  if (!save_streams(document, out))
+    return false;
+
+  return save_spdf_trailer(document, out);
+}
+
+// Size of a stream as written by serialize_spdf_stream_t.
+static size_t serialized_size(const spdf_stream_t *stream) {
+  size_t size = sizeof(stream->stream_type) + sizeof(stream->version) +
+                sizeof(stream->id) + sizeof(stream->created) +
+                sizeof(stream->updated) + sizeof(stream->position) +
+                sizeof(stream->encoding) + sizeof(stream->mime_type) +
+                sizeof(stream->compression) + sizeof(stream->offset) +
+                sizeof(stream->reading_idx) + sizeof(stream->data_size);
+  if (stream->data_size > 0 && stream->data != NULL)
+    size += stream->data_size;
+  return size;
+}
 
+typedef struct {
+  const spdf_t *document;
+  const size_t *slots;
+  const off_t *offsets;
+  int fd;
+  atomic_size_t next;
+  atomic_bool failed;
+} save_job_t;
+
+#define SAVE_BATCH 64
+
+static bool pwrite_all(int fd, const void *buf, size_t size, off_t offset) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    size -= (size_t)n;
+    offset += n;
+  }
   return true;
 }
 
+// Claims batches of streams, serializes each into memory and writes it to
+// its precomputed offset.
+static void *save_worker(void *arg) {
+  save_job_t *job = (save_job_t *)arg;
+  const spdf_t *document = job->document;
+  char *buf = NULL;
+  size_t cap = 0;
+
+  while (!atomic_load(&job->failed)) {
+    size_t first = atomic_fetch_add(&job->next, SAVE_BATCH);
+    if (first >= document->n_streams)
+      break;
+
+    size_t last = first + SAVE_BATCH;
+    if (last > document->n_streams)
+      last = document->n_streams;
+
+    for (size_t i = first; i < last; i++) {
+      size_t size = (size_t)(job->offsets[i + 1] - job->offsets[i]);
+      if (size + 1 > cap) {
+        char *tmp = (char *)realloc(buf, size + 1);
+        if (!tmp) {
+          atomic_store(&job->failed, true);
+          break;
+        }
+        buf = tmp;
+        cap = size + 1;
+      }
+
+      FILE *mem = fmemopen(buf, cap, "w");
+      if (!mem) {
+        atomic_store(&job->failed, true);
+        break;
+      }
+      setbuf(mem, NULL);
+      bool ok = serialize_spdf_stream_t(document->streams[job->slots[i]], mem);
+      ok = fclose(mem) == 0 && ok;
+
+      if (!ok || !pwrite_all(job->fd, buf, size, job->offsets[i])) {
+        atomic_store(&job->failed, true);
+        break;
+      }
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+/*
+ * Writes the same bytes as save_spdf, but lays the file out up front and
+ * has n_threads workers (0 for one per CPU) write streams into their own
+ * regions with pwrite. Falls back to save_spdf when out is not seekable.
+ */
+bool save_spdf_parallel(const spdf_t *document, FILE *out, size_t n_threads) {
+  if (n_threads == 0) {
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_cpus > 0 ? (size_t)n_cpus : 1;
+  }
+  size_t n_batches = (document->n_streams + SAVE_BATCH - 1) / SAVE_BATCH;
+  if (n_threads > n_batches)
+    n_threads = n_batches;
+
+  if (!save_spdf_header(document, out) || fflush(out) != 0)
+    return false;
+
+  // pwrite ignores the offset on O_APPEND descriptors
+  off_t base = ftello(out);
+  int flags = fcntl(fileno(out), F_GETFL);
+  if (base < 0 || flags < 0 || (flags & O_APPEND) || n_threads <= 1)
+    return save_streams(document, out) && save_spdf_trailer(document, out);
+
+  size_t *slots = (size_t *)malloc((document->n_streams + 1) * sizeof(size_t));
+  off_t *offsets =
+      (off_t *)malloc((document->n_streams + 1) * sizeof(off_t));
+  if (!slots || !offsets) {
+    free(slots);
+    free(offsets);
+    return false;
+  }
+
+  // slots has room for one extra stream, enough to detect a count mismatch
+  size_t n_saved = 0;
+  for (size_t i = 0; i < document->max_streams; ++i) {
+    if (!is_saved(document->streams[i]))
+      continue;
+    if (n_saved > document->n_streams)
+      break;
+    slots[n_saved++] = i;
+  }
+  if (n_saved != document->n_streams) {
+    free(slots);
+    free(offsets);
+    return false;
+  }
+
+  offsets[0] = base;
+  for (size_t i = 0; i < document->n_streams; ++i)
+    offsets[i + 1] =
+        offsets[i] + (off_t)serialized_size(document->streams[slots[i]]);
+
+  save_job_t job = {.document = document,
+                    .slots = slots,
+                    .offsets = offsets,
+                    .fd = fileno(out)};
+  atomic_init(&job.next, 0);
+  atomic_init(&job.failed, false);
+
+  // The calling thread is the last of the n_threads workers
+  pthread_t *threads = (pthread_t *)calloc(n_threads - 1, sizeof(pthread_t));
+  if (!threads) {
+    free(slots);
+    free(offsets);
+    return false;
+  }
+
+  size_t started = 0;
+  for (; started < n_threads - 1; started++)
+    if (pthread_create(&threads[started], NULL, save_worker, &job) != 0)
+      break;
+
+  save_worker(&job);
+
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  off_t end = offsets[document->n_streams];
+  free(threads);
+  free(slots);
+  free(offsets);
+
+  if (atomic_load(&job.failed) || fseeko(out, end, SEEK_SET) != 0)
+    return false;
+
+  return save_spdf_trailer(document, out);
+}
+
+/*
+ * Replaces the streams of document with those read from in. A document from
+ * create_spdf keeps its capacity and lock, so it stays writable after
+ * loading; a zeroed one is sized to fit what was saved.
+ */
 bool load_spdf(spdf_t *document, FILE *in) {
+  char magic[6];
+  errno = 0;
+  if (fread(magic, sizeof(magic), 1, in) < 1 || errno ||
+      memcmp(magic, "%%SPDF", sizeof(magic)))
+    return false;
+
   READ_AND_CHECK(document, version, in);
   READ_AND_CHECK(document, id, in);
   READ_AND_CHECK(document, created, in);
@@ -356,11 +717,38 @@ bool load_spdf(spdf_t *document, FILE *in) {
   READ_AND_CHECK(document, xref_offset, in);
   READ_AND_CHECK(document, n_streams, in);
 
-  document->streams =
-      (spdf_stream_t **)calloc(document->n_streams, sizeof(spdf_stream_t *));
+  // Cached payloads belong to the streams being replaced
+  spdf_cache_clear(document->cache);
+
+  if (document->streams) {
+    for (size_t i = 0; i < document->max_streams; ++i) {
+      if (document->streams[i]) {
+        free(document->streams[i]->data);
+        free(document->streams[i]);
+      }
+    }
+    free(document->streams);
+  }
+
+  if (document->max_streams < document->n_streams)
+    document->max_streams = document->n_streams;
+
+  document->streams = (spdf_stream_t **)calloc(document->max_streams + 1,
+                                               sizeof(spdf_stream_t *));
   if (document->streams == NULL)
     return false;
 
+  if (!document->lock) {
+    document->lock = (pthread_mutex_t *)calloc(1, sizeof(*document->lock));
+    if (!document->lock)
+      return false;
+    if (pthread_mutex_init(document->lock, NULL) != 0) {
+      free(document->lock);
+      document->lock = NULL;
+      return false;
+    }
+  }
+
   // Read streams
   for (size_t i = 0; i < document->n_streams; ++i) {
     document->streams[i] = (spdf_stream_t *)calloc(1, sizeof(spdf_stream_t));
@@ -370,6 +758,1974 @@ bool load_spdf(spdf_t *document, FILE *in) {
       return false;
   }
 
+  // Read packed stream blocks
+  if (!load_spdf_blocks(document, in))
+    return false;
+
+  // Read the persisted index, or rebuild it from the stream headers
+  uint8_t has_index;
+  errno = 0;
+  if (fread(&has_index, sizeof(has_index), 1, in) < 1 || errno)
+    return false;
+
+  if (document->index)
+    destroy_spdf_index(document->index);
+  document->index = NULL;
+
+  if (has_index) {
+    document->index = load_spdf_index(in);
+    if (!document->index)
+      return false;
+    document->persist_index = true;
+
+    bool in_range = document->index->n_slots >= document->max_streams;
+    for (size_t i = 0; i < document->index->n_entries; ++i)
+      if (document->index->by_created[i].slot >= document->n_streams)
+        in_range = false;
+    if (in_range)
+      return true;
+
+    // Saved for a different capacity or slot layout; rebuild instead
+    destroy_spdf_index(document->index);
+  }
+
+  document->index = create_spdf_index(document->max_streams);
+  if (!document->index)
+    return false;
+  for (size_t i = 0; i < document->n_streams; ++i)
+    index_add_stream(document->index, document->streams[i], i);
+
+  return true;
+}
+
+// cache.c
+static bool copy_payload(const spdf_stream_t *stream, void **out,
+                         size_t *out_size) {
+  *out = NULL;
+  *out_size = stream->data_size;
+  if (stream->data_size == 0 || stream->data == NULL)
+    return true;
+
+  *out = malloc(stream->data_size);
+  if (!*out)
+    return false;
+
+  memcpy(*out, stream->data, stream->data_size);
+  return true;
+}
+
+static spdf_cache_shard_t *cache_shard(spdf_cache_t *cache, const char *id,
+                                       size_t *bucket) {
+  uint32_t h = hash((unsigned char *)id);
+  *bucket = (h / cache->n_shards) % CACHE_BUCKETS;
+  return &cache->shards[h % cache->n_shards];
+}
+
+static void cache_list_remove(spdf_cache_shard_t *shard,
+                              spdf_cache_entry_t *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    shard->head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    shard->tail = entry->prev;
+
+  entry->prev = entry->next = NULL;
+}
+
+static void cache_unlink(spdf_cache_shard_t *shard, spdf_cache_entry_t *entry,
+                         size_t bucket) {
+  spdf_cache_entry_t **link = &shard->buckets[bucket];
+  while (*link && *link != entry)
+    link = &(*link)->chain;
+  if (*link)
+    *link = entry->chain;
+
+  cache_list_remove(shard, entry);
+  entry->chain = NULL;
+  entry->stale = true;
+  shard->n_entries--;
+}
+
+static void cache_free_entry(spdf_cache_t *cache, spdf_cache_shard_t *shard,
+                             spdf_cache_entry_t *entry) {
+  if (!entry->uncounted) {
+    shard->bytes -= entry->data_size;
+    atomic_fetch_sub(&cache->bytes, entry->data_size);
+  }
+  free(entry->data);
+  free(entry);
+}
+
+static void cache_push_front(spdf_cache_shard_t *shard,
+                             spdf_cache_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = shard->head;
+  if (shard->head)
+    shard->head->prev = entry;
+  shard->head = entry;
+  if (!shard->tail)
+    shard->tail = entry;
+}
+
+// Walk from the cold end, skipping pinned entries, until back under budget.
+static void cache_evict(spdf_cache_shard_t *shard, spdf_cache_t *cache) {
+  spdf_cache_entry_t *entry = shard->tail;
+  while (entry && atomic_load(&cache->bytes) > cache->budget) {
+    spdf_cache_entry_t *prev = entry->prev;
+    if (entry->pins == 0) {
+      size_t bucket;
+      cache_shard(cache, entry->id, &bucket);
+      cache_unlink(shard, entry, bucket);
+      cache_free_entry(cache, shard, entry);
+      shard->evictions++;
+    }
+    entry = prev;
+  }
+}
+
+/*
+ * Called without any shard lock held: when the shard that went over budget
+ * could not free enough on its own, take the rest from the others in turn.
+ */
+static void cache_rebalance(spdf_cache_t *cache) {
+  for (size_t i = 0;
+       i < cache->n_shards && atomic_load(&cache->bytes) > cache->budget; i++) {
+    size_t n = atomic_fetch_add(&cache->hand, 1) % cache->n_shards;
+    spdf_cache_shard_t *shard = &cache->shards[n];
+    pthread_mutex_lock(&shard->lock);
+    cache_evict(shard, cache);
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+static spdf_cache_entry_t *cache_find(spdf_cache_shard_t *shard, size_t bucket,
+                                      const char *id) {
+  for (spdf_cache_entry_t *e = shard->buckets[bucket]; e; e = e->chain)
+    if (!strncmp(e->id, id, ID_LEN))
+      return e;
+  return NULL;
+}
+
+spdf_cache_t *create_spdf_cache(size_t budget, size_t n_shards,
+                                spdf_decode_fn decode) {
+  if (n_shards == 0)
+    n_shards = CACHE_SHARDS;
+
+  spdf_cache_t *cache = (spdf_cache_t *)calloc(1, sizeof(spdf_cache_t));
+  if (!cache)
+    return NULL;
+
+  cache->shards =
+      (spdf_cache_shard_t *)calloc(n_shards, sizeof(spdf_cache_shard_t));
+  if (!cache->shards) {
+    free(cache);
+    return NULL;
+  }
+
+  cache->budget = budget;
+  atomic_init(&cache->bytes, 0);
+  atomic_init(&cache->hand, 0);
+  cache->n_shards = n_shards;
+  cache->decode = decode ? decode : copy_payload;
+
+  for (size_t i = 0; i < n_shards; i++) {
+    if (pthread_mutex_init(&cache->shards[i].lock, NULL) != 0) {
+      while (i--)
+        pthread_mutex_destroy(&cache->shards[i].lock);
+      free(cache->shards);
+      free(cache);
+      return NULL;
+    }
+  }
+
+  return cache;
+}
+
+/*
+ * Entries still pinned by a caller are leaked rather than freed under them;
+ * release every entry before destroying the cache.
+ */
+bool destroy_spdf_cache(spdf_cache_t *cache) {
+  if (!cache)
+    return false;
+
+  for (size_t i = 0; i < cache->n_shards; i++) {
+    spdf_cache_shard_t *shard = &cache->shards[i];
+    spdf_cache_entry_t *entry = shard->head;
+    while (entry) {
+      spdf_cache_entry_t *next = entry->next;
+      if (entry->pins == 0)
+        cache_free_entry(cache, shard, entry);
+      entry = next;
+    }
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  free(cache->shards);
+  free(cache);
   return true;
 }
 
+/*
+ * Looks up the payload of stream id in doc->cache. On a miss only the lookup
+ * and a copy of the encoded payload happen under the document lock; decode
+ * runs on that copy without it. If the stream was invalidated meanwhile, the
+ * result is handed out uncached rather than inserted.
+ */
+spdf_cache_entry_t *spdf_cache_get(spdf_t *doc, const char *id) {
+  if (!doc || !doc->cache || !id || !*id)
+    return NULL;
+
+  spdf_cache_t *cache = doc->cache;
+  size_t bucket;
+  spdf_cache_shard_t *shard = cache_shard(cache, id, &bucket);
+
+  pthread_mutex_lock(&shard->lock);
+  spdf_cache_entry_t *entry = cache_find(shard, bucket, id);
+  if (entry) {
+    entry->pins++;
+    shard->hits++;
+    if (entry != shard->head) {
+      cache_list_remove(shard, entry);
+      cache_push_front(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+  }
+  shard->misses++;
+  uint64_t generation = shard->generation;
+  pthread_mutex_unlock(&shard->lock);
+
+  entry = (spdf_cache_entry_t *)calloc(1, sizeof(spdf_cache_entry_t));
+  if (!entry)
+    return NULL;
+
+  spdf_stream_t copy;
+  pthread_mutex_lock(doc->lock);
+  size_t slot = find_slot(doc, id);
+  bool ok = slot != doc->max_streams;
+  if (ok) {
+    copy = *doc->streams[slot];
+    ok = copy_payload(doc->streams[slot], &copy.data, &copy.data_size);
+  }
+  pthread_mutex_unlock(doc->lock);
+  if (!ok) {
+    free(entry);
+    return NULL;
+  }
+
+  if (cache->decode == copy_payload) {
+    entry->data = copy.data;
+    entry->data_size = copy.data_size;
+  } else {
+    ok = cache->decode(&copy, &entry->data, &entry->data_size);
+    free(copy.data);
+    if (!ok) {
+      free(entry);
+      return NULL;
+    }
+  }
+  strncpy(entry->id, id, ID_LEN);
+  entry->pins = 1;
+
+  // Another reader may have cached it while this one was decoding
+  pthread_mutex_lock(&shard->lock);
+  spdf_cache_entry_t *raced = cache_find(shard, bucket, id);
+  if (raced) {
+    raced->pins++;
+    pthread_mutex_unlock(&shard->lock);
+    free(entry->data);
+    free(entry);
+    return raced;
+  }
+
+  if (shard->generation != generation || entry->data_size > cache->budget) {
+    // Possibly removed, or too large to ever fit: freed on release
+    entry->stale = true;
+    entry->uncounted = true;
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+  }
+
+  shard->bytes += entry->data_size;
+  atomic_fetch_add(&cache->bytes, entry->data_size);
+  entry->chain = shard->buckets[bucket];
+  shard->buckets[bucket] = entry;
+  shard->n_entries++;
+  cache_push_front(shard, entry);
+  cache_evict(shard, cache);
+  pthread_mutex_unlock(&shard->lock);
+  cache_rebalance(cache);
+  return entry;
+}
+
+void spdf_cache_release(spdf_cache_t *cache, spdf_cache_entry_t *entry) {
+  if (!cache || !entry)
+    return;
+
+  size_t bucket;
+  spdf_cache_shard_t *shard = cache_shard(cache, entry->id, &bucket);
+
+  pthread_mutex_lock(&shard->lock);
+  if (entry->pins > 0)
+    entry->pins--;
+  if (entry->pins == 0) {
+    if (entry->stale)
+      cache_free_entry(cache, shard, entry);
+    else
+      cache_evict(shard, cache);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  cache_rebalance(cache);
+}
+
+bool spdf_cache_invalidate(spdf_cache_t *cache, const char *id) {
+  if (!cache || !id)
+    return false;
+
+  size_t bucket;
+  spdf_cache_shard_t *shard = cache_shard(cache, id, &bucket);
+
+  pthread_mutex_lock(&shard->lock);
+  shard->generation++;
+  spdf_cache_entry_t *entry = cache_find(shard, bucket, id);
+  if (!entry) {
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+  }
+
+  cache_unlink(shard, entry, bucket);
+  if (entry->pins == 0)
+    cache_free_entry(cache, shard, entry);
+  pthread_mutex_unlock(&shard->lock);
+  return true;
+}
+
+// Drops every entry; pinned ones are freed when released.
+void spdf_cache_clear(spdf_cache_t *cache) {
+  if (!cache)
+    return;
+
+  for (size_t i = 0; i < cache->n_shards; i++) {
+    spdf_cache_shard_t *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    shard->generation++;
+    while (shard->head) {
+      spdf_cache_entry_t *entry = shard->head;
+      size_t bucket;
+      cache_shard(cache, entry->id, &bucket);
+      cache_unlink(shard, entry, bucket);
+      if (entry->pins == 0)
+        cache_free_entry(cache, shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void spdf_cache_stats(spdf_cache_t *cache, spdf_cache_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!cache)
+    return;
+
+  for (size_t i = 0; i < cache->n_shards; i++) {
+    spdf_cache_shard_t *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    stats->bytes += shard->bytes;
+    stats->n_entries += shard->n_entries;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+// index.c
+static uint8_t index_value(const spdf_stream_t *stream, enum index_attr attr) {
+  switch (attr) {
+  case INDEX_STREAM_TYPE:
+    return stream->stream_type;
+  case INDEX_ENCODING:
+    return stream->encoding;
+  case INDEX_MIME_TYPE:
+    return stream->mime_type;
+  case INDEX_COMPRESSION:
+    return stream->compression;
+  default:
+    return 0;
+  }
+}
+
+static size_t time_lower_bound(const spdf_time_entry_t *entries, size_t n,
+                               time_t t) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].time < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void time_insert(spdf_time_entry_t *entries, size_t n, time_t t,
+                        size_t slot) {
+  size_t i = time_lower_bound(entries, n, t + 1);
+  memmove(&entries[i + 1], &entries[i], (n - i) * sizeof(*entries));
+  entries[i].time = t;
+  entries[i].slot = slot;
+}
+
+static void time_remove(spdf_time_entry_t *entries, size_t n, time_t t,
+                        size_t slot) {
+  for (size_t i = time_lower_bound(entries, n, t); i < n; i++) {
+    if (entries[i].time != t)
+      return;
+    if (entries[i].slot == slot) {
+      memmove(&entries[i], &entries[i + 1], (n - i - 1) * sizeof(*entries));
+      return;
+    }
+  }
+}
+
+// Mark the slots whose time falls in [after, before) in a fresh bitmap.
+static void time_range(const spdf_index_t *index,
+                       const spdf_time_entry_t *entries, time_t after,
+                       time_t before, uint64_t *out) {
+  memset(out, 0, index->n_words * sizeof(uint64_t));
+  for (size_t i = time_lower_bound(entries, index->n_entries, after);
+       i < index->n_entries; i++) {
+    if (before && entries[i].time >= before)
+      break;
+    out[entries[i].slot / 64] |= UINT64_C(1) << (entries[i].slot % 64);
+  }
+}
+
+spdf_index_t *create_spdf_index(size_t n_slots) {
+  spdf_index_t *index = (spdf_index_t *)calloc(1, sizeof(spdf_index_t));
+  if (!index)
+    return NULL;
+
+  index->n_slots = n_slots;
+  index->n_words = (n_slots + 63) / 64;
+  index->live = (uint64_t *)calloc(index->n_words + 1, sizeof(uint64_t));
+  index->by_created =
+      (spdf_time_entry_t *)calloc(n_slots + 1, sizeof(spdf_time_entry_t));
+  index->by_updated =
+      (spdf_time_entry_t *)calloc(n_slots + 1, sizeof(spdf_time_entry_t));
+  if (!index->live || !index->by_created || !index->by_updated) {
+    destroy_spdf_index(index);
+    return NULL;
+  }
+
+  return index;
+}
+
+bool destroy_spdf_index(spdf_index_t *index) {
+  if (!index)
+    return false;
+
+  for (size_t a = 0; a < INDEX_ATTRS; a++)
+    for (size_t v = 0; v < INDEX_VALUES; v++)
+      free(index->bitmaps[a][v]);
+
+  free(index->live);
+  free(index->by_created);
+  free(index->by_updated);
+  free(index);
+  return true;
+}
+
+// Zero-extends a bitmap of old_words + 1 words to n_words + 1.
+static bool grow_bitmap(uint64_t **bitmap, size_t old_words, size_t n_words) {
+  uint64_t *grown =
+      (uint64_t *)realloc(*bitmap, (n_words + 1) * sizeof(uint64_t));
+  if (!grown)
+    return false;
+  memset(grown + old_words, 0, (n_words + 1 - old_words) * sizeof(uint64_t));
+  *bitmap = grown;
+  return true;
+}
+
+// Makes room for n_slots slots. A failure leaves the index usable as it was.
+static bool grow_spdf_index(spdf_index_t *index, size_t n_slots) {
+  if (n_slots <= index->n_slots)
+    return true;
+
+  size_t n_words = (n_slots + 63) / 64;
+  if (!grow_bitmap(&index->live, index->n_words, n_words))
+    return false;
+  for (size_t a = 0; a < INDEX_ATTRS; a++)
+    for (size_t v = 0; v < INDEX_VALUES; v++)
+      if (index->bitmaps[a][v] &&
+          !grow_bitmap(&index->bitmaps[a][v], index->n_words, n_words))
+        return false;
+
+  spdf_time_entry_t *by_created = (spdf_time_entry_t *)realloc(
+      index->by_created, (n_slots + 1) * sizeof(spdf_time_entry_t));
+  if (!by_created)
+    return false;
+  index->by_created = by_created;
+
+  spdf_time_entry_t *by_updated = (spdf_time_entry_t *)realloc(
+      index->by_updated, (n_slots + 1) * sizeof(spdf_time_entry_t));
+  if (!by_updated)
+    return false;
+  index->by_updated = by_updated;
+
+  index->n_slots = n_slots;
+  index->n_words = n_words;
+  return true;
+}
+
+bool index_add_stream(spdf_index_t *index, const spdf_stream_t *stream,
+                      size_t slot) {
+  if (!index || !stream || slot >= index->n_slots)
+    return false;
+
+  uint64_t bit = UINT64_C(1) << (slot % 64);
+  if (index->live[slot / 64] & bit)
+    return false;
+
+  // Allocate every bitmap first so a failure leaves the index untouched.
+  for (size_t a = 0; a < INDEX_ATTRS; a++) {
+    uint8_t v = index_value(stream, (enum index_attr)a);
+    if (!index->bitmaps[a][v]) {
+      index->bitmaps[a][v] =
+          (uint64_t *)calloc(index->n_words + 1, sizeof(uint64_t));
+      if (!index->bitmaps[a][v])
+        return false;
+    }
+  }
+
+  for (size_t a = 0; a < INDEX_ATTRS; a++)
+    index->bitmaps[a][index_value(stream, (enum index_attr)a)][slot / 64] |=
+        bit;
+
+  time_insert(index->by_created, index->n_entries, stream->created, slot);
+  time_insert(index->by_updated, index->n_entries, stream->updated, slot);
+  index->live[slot / 64] |= bit;
+  index->n_entries++;
+  return true;
+}
+
+bool index_remove_stream(spdf_index_t *index, const spdf_stream_t *stream,
+                         size_t slot) {
+  if (!index || !stream || slot >= index->n_slots)
+    return false;
+
+  uint64_t bit = UINT64_C(1) << (slot % 64);
+  if (!(index->live[slot / 64] & bit))
+    return false;
+
+  for (size_t a = 0; a < INDEX_ATTRS; a++) {
+    uint64_t *bitmap = index->bitmaps[a][index_value(stream, (enum index_attr)a)];
+    if (bitmap)
+      bitmap[slot / 64] &= ~bit;
+  }
+
+  time_remove(index->by_created, index->n_entries, stream->created, slot);
+  time_remove(index->by_updated, index->n_entries, stream->updated, slot);
+  index->live[slot / 64] &= ~bit;
+  index->n_entries--;
+  return true;
+}
+
+/*
+ * Resolves the query from the index alone and returns the number of matching
+ * streams. At most max_out of them are written to out, in slot order.
+ */
+size_t query_streams(spdf_t *doc, const spdf_query_t *query,
+                     spdf_stream_t **out, size_t max_out) {
+  if (!doc || !doc->index || !query)
+    return 0;
+
+  if (doc->lock)
+    pthread_mutex_lock(doc->lock);
+  spdf_index_t *index = doc->index;
+
+  uint64_t *match = (uint64_t *)calloc(index->n_words + 1, sizeof(uint64_t));
+  uint64_t *range = (uint64_t *)calloc(index->n_words + 1, sizeof(uint64_t));
+  if (!match || !range) {
+    free(match);
+    free(range);
+    if (doc->lock)
+      pthread_mutex_unlock(doc->lock);
+    return 0;
+  }
+  memcpy(match, index->live, index->n_words * sizeof(uint64_t));
+
+  const int values[INDEX_ATTRS] = {query->stream_type, query->encoding,
+                                   query->mime_type, query->compression};
+  for (size_t a = 0; a < INDEX_ATTRS; a++) {
+    if (values[a] < 0)
+      continue;
+    const uint64_t *bitmap =
+        values[a] < INDEX_VALUES ? index->bitmaps[a][values[a]] : NULL;
+    for (size_t w = 0; w < index->n_words; w++)
+      match[w] &= bitmap ? bitmap[w] : 0;
+  }
+
+  if (query->created_after || query->created_before) {
+    time_range(index, index->by_created, query->created_after,
+               query->created_before, range);
+    for (size_t w = 0; w < index->n_words; w++)
+      match[w] &= range[w];
+  }
+
+  if (query->updated_after || query->updated_before) {
+    time_range(index, index->by_updated, query->updated_after,
+               query->updated_before, range);
+    for (size_t w = 0; w < index->n_words; w++)
+      match[w] &= range[w];
+  }
+
+  size_t n = 0;
+  for (size_t w = 0; w < index->n_words; w++) {
+    for (uint64_t bits = match[w]; bits; bits &= bits - 1) {
+      if (n < max_out && out)
+        out[n] = doc->streams[w * 64 + (size_t)__builtin_ctzll(bits)];
+      n++;
+    }
+  }
+
+  free(match);
+  free(range);
+  if (doc->lock)
+    pthread_mutex_unlock(doc->lock);
+  return n;
+}
+
+/*
+ * Copies doc->index with every slot renumbered to the position its stream
+ * takes in a saved file, where the placeholders of removed streams are
+ * skipped.
+ */
+spdf_index_t *compact_spdf_index(const spdf_t *doc) {
+  const spdf_index_t *index = doc->index;
+  size_t *rank = (size_t *)malloc((index->n_slots + 1) * sizeof(size_t));
+  spdf_index_t *compacted = create_spdf_index(index->n_slots);
+  if (!rank || !compacted) {
+    free(rank);
+    destroy_spdf_index(compacted);
+    return NULL;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < index->n_slots; i++)
+    rank[i] = i < doc->max_streams && is_saved(doc->streams[i]) ? n++ : 0;
+
+  for (size_t w = 0; w < index->n_words; w++) {
+    for (uint64_t bits = index->live[w]; bits; bits &= bits - 1) {
+      size_t slot = w * 64 + (size_t)__builtin_ctzll(bits);
+      size_t to = rank[slot];
+      uint64_t bit = UINT64_C(1) << (to % 64);
+      compacted->live[to / 64] |= bit;
+
+      for (size_t a = 0; a < INDEX_ATTRS; a++) {
+        for (size_t v = 0; v < INDEX_VALUES; v++) {
+          const uint64_t *from = index->bitmaps[a][v];
+          if (!from || !(from[w] & (UINT64_C(1) << (slot % 64))))
+            continue;
+          if (!compacted->bitmaps[a][v]) {
+            compacted->bitmaps[a][v] =
+                (uint64_t *)calloc(index->n_words + 1, sizeof(uint64_t));
+            if (!compacted->bitmaps[a][v]) {
+              free(rank);
+              destroy_spdf_index(compacted);
+              return NULL;
+            }
+          }
+          compacted->bitmaps[a][v][to / 64] |= bit;
+          break;
+        }
+      }
+    }
+  }
+
+  // Ranks keep slot order, so the time indexes stay sorted
+  compacted->n_entries = index->n_entries;
+  for (size_t i = 0; i < index->n_entries; i++) {
+    compacted->by_created[i].time = index->by_created[i].time;
+    compacted->by_created[i].slot = rank[index->by_created[i].slot];
+    compacted->by_updated[i].time = index->by_updated[i].time;
+    compacted->by_updated[i].slot = rank[index->by_updated[i].slot];
+  }
+
+  free(rank);
+  return compacted;
+}
+
+bool save_spdf_index(const spdf_index_t *index, FILE *out) {
+  WRITE_AND_CHECK(index, n_slots, out);
+  WRITE_AND_CHECK(index, n_entries, out);
+
+  errno = 0;
+  if (index->n_words &&
+      (fwrite(index->live, sizeof(uint64_t), index->n_words, out) <
+           index->n_words ||
+       errno))
+    return false;
+
+  for (size_t a = 0; a < INDEX_ATTRS; a++) {
+    uint16_t n_bitmaps = 0;
+    for (size_t v = 0; v < INDEX_VALUES; v++)
+      if (index->bitmaps[a][v])
+        n_bitmaps++;
+
+    errno = 0;
+    if (fwrite(&n_bitmaps, sizeof(n_bitmaps), 1, out) < 1 || errno)
+      return false;
+
+    for (size_t v = 0; v < INDEX_VALUES; v++) {
+      if (!index->bitmaps[a][v])
+        continue;
+      uint8_t value = (uint8_t)v;
+      errno = 0;
+      if (fwrite(&value, sizeof(value), 1, out) < 1 || errno)
+        return false;
+      if (index->n_words &&
+          (fwrite(index->bitmaps[a][v], sizeof(uint64_t), index->n_words,
+                  out) < index->n_words ||
+           errno))
+        return false;
+    }
+  }
+
+  errno = 0;
+  if (index->n_entries &&
+      (fwrite(index->by_created, sizeof(spdf_time_entry_t), index->n_entries,
+              out) < index->n_entries ||
+       fwrite(index->by_updated, sizeof(spdf_time_entry_t), index->n_entries,
+              out) < index->n_entries ||
+       errno))
+    return false;
+
+  return true;
+}
+
+static bool read_spdf_index(spdf_index_t *index, FILE *in) {
+  errno = 0;
+  if (index->n_words &&
+      (fread(index->live, sizeof(uint64_t), index->n_words, in) <
+           index->n_words ||
+       errno))
+    return false;
+
+  for (size_t a = 0; a < INDEX_ATTRS; a++) {
+    uint16_t n_bitmaps;
+    errno = 0;
+    if (fread(&n_bitmaps, sizeof(n_bitmaps), 1, in) < 1 || errno)
+      return false;
+
+    for (uint16_t i = 0; i < n_bitmaps; i++) {
+      uint8_t value;
+      errno = 0;
+      if (fread(&value, sizeof(value), 1, in) < 1 || errno ||
+          index->bitmaps[a][value])
+        return false;
+      index->bitmaps[a][value] =
+          (uint64_t *)calloc(index->n_words + 1, sizeof(uint64_t));
+      if (!index->bitmaps[a][value])
+        return false;
+      if (index->n_words &&
+          (fread(index->bitmaps[a][value], sizeof(uint64_t), index->n_words,
+                 in) < index->n_words ||
+           errno))
+        return false;
+    }
+  }
+
+  errno = 0;
+  if (index->n_entries &&
+      (fread(index->by_created, sizeof(spdf_time_entry_t), index->n_entries,
+             in) < index->n_entries ||
+       fread(index->by_updated, sizeof(spdf_time_entry_t), index->n_entries,
+             in) < index->n_entries ||
+       errno))
+    return false;
+
+  for (size_t i = 0; i < index->n_entries; i++)
+    if (index->by_created[i].slot >= index->n_slots ||
+        index->by_updated[i].slot >= index->n_slots)
+      return false;
+
+  return true;
+}
+
+spdf_index_t *load_spdf_index(FILE *in) {
+  size_t n_slots, n_entries;
+
+  errno = 0;
+  if (fread(&n_slots, sizeof(n_slots), 1, in) < 1 ||
+      fread(&n_entries, sizeof(n_entries), 1, in) < 1 || errno)
+    return NULL;
+  if (n_entries > n_slots)
+    return NULL;
+
+  spdf_index_t *index = create_spdf_index(n_slots);
+  if (!index)
+    return NULL;
+  index->n_entries = n_entries;
+
+  if (!read_spdf_index(index, in)) {
+    destroy_spdf_index(index);
+    return NULL;
+  }
+
+  return index;
+}
+
+// block.c
+spdf_block_t *create_spdf_block(void) {
+  spdf_block_t *block = (spdf_block_t *)calloc(1, sizeof(spdf_block_t));
+  if (!block)
+    return NULL;
+
+  block->created = time(NULL);
+  return block;
+}
+
+bool destroy_spdf_block(spdf_block_t *block) {
+  if (!block)
+    return false;
+  free(block->payload);
+  free(block);
+  return true;
+}
+
+static bool reserve_payload(spdf_block_t *block, size_t size) {
+  size_t needed = block->payload_size + size;
+  if (needed <= block->payload_cap)
+    return true;
+
+  size_t cap = block->payload_cap ? block->payload_cap : 64;
+  while (cap < needed)
+    cap *= 2;
+  if (cap > BLOCK_PAYLOAD_MAX)
+    cap = BLOCK_PAYLOAD_MAX;
+
+  uint8_t *payload = (uint8_t *)realloc(block->payload, cap);
+  if (!payload)
+    return false;
+
+  block->payload = payload;
+  block->payload_cap = (uint32_t)cap;
+  return true;
+}
+
+// Makes room for n_blocks block pointers.
+static bool reserve_blocks(spdf_t *doc, size_t n_blocks) {
+  if (n_blocks <= doc->max_blocks)
+    return true;
+
+  size_t max_blocks = doc->max_blocks ? doc->max_blocks * 2 : 8;
+  while (max_blocks < n_blocks)
+    max_blocks *= 2;
+  spdf_block_t **blocks = (spdf_block_t **)realloc(
+      doc->blocks, max_blocks * sizeof(spdf_block_t *));
+  if (!blocks)
+    return false;
+  doc->blocks = blocks;
+  doc->max_blocks = max_blocks;
+  return true;
+}
+
+static bool block_fits(const spdf_block_t *block, size_t size, time_t now) {
+  return block->n_entries < BLOCK_ENTRIES &&
+         block->payload_size + size <= BLOCK_PAYLOAD_MAX &&
+         now >= block->created &&
+         (uint64_t)(now - block->created) <= UINT32_MAX;
+}
+
+// Returns the block the next packed stream of this size goes into.
+static spdf_block_t *writable_block(spdf_t *doc, size_t size, time_t now) {
+  spdf_block_t *last = doc->n_blocks ? doc->blocks[doc->n_blocks - 1] : NULL;
+  if (last && block_fits(last, size, now))
+    return last;
+
+  if (doc->n_blocks >= UINT32_MAX || !reserve_blocks(doc, doc->n_blocks + 1))
+    return NULL;
+
+  spdf_block_t *block = create_spdf_block();
+  if (!block)
+    return NULL;
+
+  doc->blocks[doc->n_blocks++] = block;
+  return block;
+}
+
+static bool append_entry(spdf_block_t *block, const void *data, size_t size,
+                         uint8_t encoding, uint8_t mime_type, time_t now) {
+  if (!reserve_payload(block, size))
+    return false;
+
+  spdf_block_entry_t *entry = &block->entries[block->n_entries];
+  entry->created = (uint32_t)(now - block->created);
+  entry->offset = (uint16_t)block->payload_size;
+  entry->size = (uint8_t)size;
+  entry->encoding = encoding;
+  entry->mime_type = mime_type;
+  entry->compression = NO_COMPRESSION;
+  entry->live = 1;
+
+  if (size)
+    memcpy(block->payload + block->payload_size, data, size);
+  block->payload_size += (uint32_t)size;
+  block->n_entries++;
+  block->n_live++;
+  return true;
+}
+
+static spdf_block_entry_t *find_entry(spdf_t *doc, spdf_ref_t ref,
+                                      spdf_block_t **block) {
+  if (ref.block >= doc->n_blocks)
+    return NULL;
+
+  *block = doc->blocks[ref.block];
+  if (!*block || ref.index >= (*block)->n_entries ||
+      !(*block)->entries[ref.index].live)
+    return NULL;
+
+  return &(*block)->entries[ref.index];
+}
+
+// Moves the live payloads to the front and gives back the spare capacity.
+static void compact_block(spdf_block_t *block) {
+  uint32_t size = 0;
+  for (uint16_t i = 0; i < block->n_entries; i++) {
+    spdf_block_entry_t *entry = &block->entries[i];
+    if (!entry->live) {
+      entry->offset = 0;
+      entry->size = 0;
+      continue;
+    }
+    // Offsets only grow with the index, so moving down never overlaps ahead
+    if (entry->size)
+      memmove(block->payload + size, block->payload + entry->offset,
+              entry->size);
+    entry->offset = (uint16_t)size;
+    size += entry->size;
+  }
+  block->payload_size = size;
+
+  if (size && block->payload_cap > 2 * size) {
+    uint8_t *payload = (uint8_t *)realloc(block->payload, size);
+    if (payload) {
+      block->payload = payload;
+      block->payload_cap = size;
+    }
+  }
+}
+
+/*
+ * Frees a block with no live entries, leaving its slot NULL, or compacts one
+ * that is at least half dead. Blocks with removals still waiting for their
+ * WAL sync are left alone, since those removals may yet be undone.
+ */
+static void reclaim_block(spdf_t *doc, uint32_t n) {
+  spdf_block_t *block = doc->blocks[n];
+  if (!block || block->n_pending)
+    return;
+
+  if (!block->n_live) {
+    destroy_spdf_block(block);
+    doc->blocks[n] = NULL;
+    return;
+  }
+
+  uint32_t live = 0;
+  for (uint16_t i = 0; i < block->n_entries; i++)
+    if (block->entries[i].live)
+      live += block->entries[i].size;
+  if (block->payload_size - live >= block->payload_size / 2 &&
+      block->payload_size > live)
+    compact_block(block);
+}
+
+static uint64_t wal_log_packed_add(spdf_wal_t *wal, spdf_ref_t ref,
+                                   time_t created, uint8_t encoding,
+                                   uint8_t mime_type, const void *data,
+                                   size_t size);
+static uint64_t wal_log_packed_remove(spdf_wal_t *wal, spdf_ref_t ref);
+
+/*
+ * Copies a payload of at most PACKED_STREAM_MAX bytes into the current block
+ * and stores its (block, index) reference in ref. With a WAL attached, it
+ * returns once the stream is durable, as add_stream does.
+ */
+bool add_packed_stream(spdf_t *doc, const void *data, size_t size,
+                       uint8_t encoding, uint8_t mime_type, spdf_ref_t *ref) {
+  if (!doc || !ref || size > PACKED_STREAM_MAX || (size && !data))
+    return false;
+
+  pthread_mutex_lock(doc->lock);
+
+  time_t now = time(NULL);
+  spdf_block_t *block = writable_block(doc, size, now);
+  if (!block || !append_entry(block, data, size, encoding, mime_type, now)) {
+    pthread_mutex_unlock(doc->lock);
+    return false;
+  }
+
+  ref->block = (uint32_t)(doc->n_blocks - 1);
+  ref->index = (uint16_t)(block->n_entries - 1);
+
+  spdf_wal_t *wal = doc->wal;
+  uint64_t lsn = 0;
+  if (wal && !(lsn = wal_log_packed_add(wal, *ref, now, encoding, mime_type,
+                                        data, size))) {
+    // Nothing was appended after this entry while the lock was held
+    block->n_entries--;
+    block->n_live--;
+    block->payload_size -= (uint32_t)size;
+    pthread_mutex_unlock(doc->lock);
+    return false;
+  }
+
+  doc->updated = now;
+  pthread_mutex_unlock(doc->lock);
+
+  if (!lsn || sync_spdf_wal(wal, lsn))
+    return true;
+
+  pthread_mutex_lock(doc->lock);
+  spdf_block_entry_t *entry = find_entry(doc, *ref, &block);
+  if (entry) {
+    entry->live = 0;
+    block->n_live--;
+    reclaim_block(doc, ref->block);
+  }
+  pthread_mutex_unlock(doc->lock);
+  return false;
+}
+
+/*
+ * A block whose last stream is removed is freed and its slot left NULL, so
+ * later blocks keep their numbers. Dead payload bytes in a live block are
+ * reclaimed in memory once they make up half of its payload.
+ */
+bool remove_packed_stream(spdf_t *doc, spdf_ref_t ref) {
+  if (!doc)
+    return false;
+
+  pthread_mutex_lock(doc->lock);
+
+  spdf_block_t *block;
+  spdf_block_entry_t *entry = find_entry(doc, ref, &block);
+  if (!entry) {
+    pthread_mutex_unlock(doc->lock);
+    return false;
+  }
+
+  spdf_wal_t *wal = doc->wal;
+  uint64_t lsn = 0;
+  if (wal && !(lsn = wal_log_packed_remove(wal, ref))) {
+    pthread_mutex_unlock(doc->lock);
+    return false;
+  }
+
+  entry->live = 0;
+  block->n_live--;
+  doc->updated = time(NULL);
+  if (!lsn) {
+    reclaim_block(doc, ref.block);
+    pthread_mutex_unlock(doc->lock);
+    return true;
+  }
+
+  // The block keeps its slot and bytes until the removal is durable
+  block->n_pending++;
+  pthread_mutex_unlock(doc->lock);
+
+  bool ok = sync_spdf_wal(wal, lsn);
+
+  pthread_mutex_lock(doc->lock);
+  block->n_pending--;
+  if (!ok) {
+    entry->live = 1;
+    block->n_live++;
+  }
+  reclaim_block(doc, ref.block);
+  pthread_mutex_unlock(doc->lock);
+  return ok;
+}
+
+// Copies up to cap bytes of the payload into buf and its full size into size.
+bool read_packed_stream(spdf_t *doc, spdf_ref_t ref, void *buf, size_t cap,
+                        size_t *size) {
+  if (!doc || !size)
+    return false;
+
+  pthread_mutex_lock(doc->lock);
+
+  spdf_block_t *block;
+  spdf_block_entry_t *entry = find_entry(doc, ref, &block);
+  if (!entry) {
+    pthread_mutex_unlock(doc->lock);
+    return false;
+  }
+
+  *size = entry->size;
+  if (buf)
+    memcpy(buf, block->payload + entry->offset,
+           entry->size < cap ? entry->size : cap);
+
+  pthread_mutex_unlock(doc->lock);
+  return true;
+}
+
+/*
+ * Writes the payloads of live entries only, with their offsets rewritten to
+ * match. Dead entries keep their place in the table with a size of 0.
+ */
+static bool save_block(const spdf_block_t *block, FILE *out) {
+  spdf_block_t saved = {.created = block->created,
+                        .n_entries = block->n_entries,
+                        .n_live = block->n_live};
+
+  for (uint16_t i = 0; i < block->n_entries; i++) {
+    spdf_block_entry_t *entry = &saved.entries[i];
+    *entry = block->entries[i];
+    if (!entry->live) {
+      entry->offset = 0;
+      entry->size = 0;
+      continue;
+    }
+    entry->offset = (uint16_t)saved.payload_size;
+    saved.payload_size += entry->size;
+  }
+
+  WRITE_AND_CHECK(&saved, created, out);
+  WRITE_AND_CHECK(&saved, n_entries, out);
+  WRITE_AND_CHECK(&saved, n_live, out);
+  WRITE_AND_CHECK(&saved, payload_size, out);
+
+  errno = 0;
+  if (saved.n_entries &&
+      (fwrite(saved.entries, sizeof(spdf_block_entry_t), saved.n_entries,
+              out) < saved.n_entries ||
+       errno))
+    return false;
+
+  for (uint16_t i = 0; i < block->n_entries; i++) {
+    const spdf_block_entry_t *entry = &block->entries[i];
+    if (entry->live && entry->size &&
+        (fwrite(block->payload + entry->offset, entry->size, 1, out) < 1 ||
+         errno))
+      return false;
+  }
+
+  return true;
+}
+
+// A freed block is written as an empty one and loaded back as NULL.
+bool save_spdf_blocks(const spdf_t *document, FILE *out) {
+  WRITE_AND_CHECK(document, n_blocks, out);
+
+  const spdf_block_t empty = {0};
+  for (size_t i = 0; i < document->n_blocks; i++)
+    if (!save_block(document->blocks[i] ? document->blocks[i] : &empty, out))
+      return false;
+
+  return true;
+}
+
+static bool load_block(spdf_block_t *block, FILE *in) {
+  READ_AND_CHECK(block, created, in);
+  READ_AND_CHECK(block, n_entries, in);
+  READ_AND_CHECK(block, n_live, in);
+  READ_AND_CHECK(block, payload_size, in);
+
+  if (block->n_entries > BLOCK_ENTRIES || block->n_live > block->n_entries ||
+      block->payload_size > BLOCK_PAYLOAD_MAX)
+    return false;
+
+  errno = 0;
+  if (block->n_entries &&
+      (fread(block->entries, sizeof(spdf_block_entry_t), block->n_entries,
+             in) < block->n_entries ||
+       errno))
+    return false;
+
+  uint32_t payload_size = block->payload_size;
+  block->payload_size = 0;
+  if (!reserve_payload(block, payload_size))
+    return false;
+  block->payload_size = payload_size;
+
+  errno = 0;
+  if (payload_size && (fread(block->payload, payload_size, 1, in) < 1 || errno))
+    return false;
+
+  for (uint16_t i = 0; i < block->n_entries; i++)
+    if ((uint32_t)block->entries[i].offset + block->entries[i].size >
+        payload_size)
+      return false;
+
+  return true;
+}
+
+bool load_spdf_blocks(spdf_t *document, FILE *in) {
+  size_t n_blocks;
+  errno = 0;
+  if (fread(&n_blocks, sizeof(n_blocks), 1, in) < 1 || errno)
+    return false;
+  if (n_blocks > UINT32_MAX)
+    return false;
+
+  spdf_block_t **blocks = NULL;
+  if (n_blocks) {
+    blocks = (spdf_block_t **)calloc(n_blocks, sizeof(spdf_block_t *));
+    if (!blocks)
+      return false;
+  }
+
+  for (size_t i = 0; i < n_blocks; i++) {
+    blocks[i] = create_spdf_block();
+    if (!blocks[i] || !load_block(blocks[i], in)) {
+      for (size_t j = 0; j <= i; j++)
+        destroy_spdf_block(blocks[j]);
+      free(blocks);
+      return false;
+    }
+    if (!blocks[i]->n_live) {
+      destroy_spdf_block(blocks[i]);
+      blocks[i] = NULL;
+    }
+  }
+
+  for (size_t i = 0; i < document->n_blocks; i++)
+    destroy_spdf_block(document->blocks[i]);
+  free(document->blocks);
+
+  document->blocks = blocks;
+  document->n_blocks = document->max_blocks = n_blocks;
+  return true;
+}
+
+// wal.c
+#define WAL_HEADER (sizeof(uint8_t) + sizeof(uint32_t))
+#define WAL_TRAILER sizeof(uint32_t)
+
+// FNV-1a, enough to spot a torn or partially written record.
+static uint32_t wal_checksum(const uint8_t *data, size_t size) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    h ^= data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool write_all(int fd, const void *buf, size_t size) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    size -= (size_t)n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, void *buf, size_t size, off_t offset) {
+  char *p = (char *)buf;
+  while (size > 0) {
+    ssize_t n = pread(fd, p, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= (size_t)n;
+    offset += n;
+  }
+  return true;
+}
+
+// Makes a rename in the directory holding path durable.
+static bool sync_parent(const char *path) {
+  char *copy = strdup(path);
+  if (!copy)
+    return false;
+
+  int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+  free(copy);
+  if (fd < 0)
+    return false;
+
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+static char *tmp_path(const char *path) {
+  size_t len = strlen(path);
+  char *tmp = (char *)malloc(len + sizeof(".tmp"));
+  if (!tmp)
+    return NULL;
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+  return tmp;
+}
+
+// Returns the record's LSN, or 0 if it could not be buffered.
+static uint64_t wal_append(spdf_wal_t *wal, uint8_t op, const void *payload,
+                           uint32_t size) {
+  size_t record = WAL_HEADER + size + WAL_TRAILER;
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->failed) {
+    pthread_mutex_unlock(&wal->lock);
+    return 0;
+  }
+
+  if (wal->buf_size + record > wal->buf_cap) {
+    size_t cap = wal->buf_cap ? wal->buf_cap : 4096;
+    while (cap < wal->buf_size + record)
+      cap *= 2;
+    uint8_t *buf = (uint8_t *)realloc(wal->buf, cap);
+    if (!buf) {
+      pthread_mutex_unlock(&wal->lock);
+      return 0;
+    }
+    wal->buf = buf;
+    wal->buf_cap = cap;
+  }
+
+  uint8_t *p = wal->buf + wal->buf_size;
+  p[0] = op;
+  memcpy(p + sizeof(uint8_t), &size, sizeof(size));
+  if (size)
+    memcpy(p + WAL_HEADER, payload, size);
+  uint32_t sum = wal_checksum(p, WAL_HEADER + size);
+  memcpy(p + WAL_HEADER + size, &sum, sizeof(sum));
+
+  wal->buf_size += record;
+  wal->end += record;
+  uint64_t lsn = ++wal->appended_lsn;
+  pthread_mutex_unlock(&wal->lock);
+  return lsn;
+}
+
+static uint64_t wal_log_add(spdf_wal_t *wal, const spdf_stream_t *stream) {
+  size_t size = serialized_size(stream);
+  if (size > UINT32_MAX)
+    return 0;
+
+  char *buf = (char *)malloc(size + 1);
+  if (!buf)
+    return 0;
+
+  FILE *mem = fmemopen(buf, size + 1, "w");
+  if (!mem) {
+    free(buf);
+    return 0;
+  }
+  setbuf(mem, NULL);
+  bool ok = serialize_spdf_stream_t(stream, mem);
+  ok = fclose(mem) == 0 && ok;
+
+  uint64_t lsn = ok ? wal_append(wal, WAL_ADD, buf, (uint32_t)size) : 0;
+  free(buf);
+  return lsn;
+}
+
+static uint64_t wal_log_remove(spdf_wal_t *wal, const char *id) {
+  return wal_append(wal, WAL_REMOVE, id, ID_LEN);
+}
+
+// A packed record starts with the ref: block (4 bytes) and index (2 bytes).
+#define WAL_REF (sizeof(uint32_t) + sizeof(uint16_t))
+// An add goes on with created (8 bytes), encoding, MIME type and the payload.
+#define WAL_PACKED_HEADER (WAL_REF + sizeof(int64_t) + 2 * sizeof(uint8_t))
+
+static void wal_put_ref(uint8_t *p, spdf_ref_t ref) {
+  memcpy(p, &ref.block, sizeof(ref.block));
+  memcpy(p + sizeof(ref.block), &ref.index, sizeof(ref.index));
+}
+
+static spdf_ref_t wal_get_ref(const uint8_t *p) {
+  spdf_ref_t ref;
+  memcpy(&ref.block, p, sizeof(ref.block));
+  memcpy(&ref.index, p + sizeof(ref.block), sizeof(ref.index));
+  return ref;
+}
+
+static uint64_t wal_log_packed_add(spdf_wal_t *wal, spdf_ref_t ref,
+                                   time_t created, uint8_t encoding,
+                                   uint8_t mime_type, const void *data,
+                                   size_t size) {
+  uint8_t record[WAL_PACKED_HEADER + PACKED_STREAM_MAX];
+  int64_t when = (int64_t)created;
+
+  wal_put_ref(record, ref);
+  memcpy(record + WAL_REF, &when, sizeof(when));
+  record[WAL_REF + sizeof(when)] = encoding;
+  record[WAL_REF + sizeof(when) + 1] = mime_type;
+  if (size)
+    memcpy(record + WAL_PACKED_HEADER, data, size);
+
+  return wal_append(wal, WAL_PACKED_ADD, record,
+                    (uint32_t)(WAL_PACKED_HEADER + size));
+}
+
+static uint64_t wal_log_packed_remove(spdf_wal_t *wal, spdf_ref_t ref) {
+  uint8_t record[WAL_REF];
+  wal_put_ref(record, ref);
+  return wal_append(wal, WAL_PACKED_REMOVE, record, WAL_REF);
+}
+
+/*
+ * Blocks until every record up to lsn is on disk. The first waiter becomes
+ * the leader and writes out everything buffered so far with one fdatasync;
+ * the others wait for it and usually find their record already covered.
+ */
+bool sync_spdf_wal(spdf_wal_t *wal, uint64_t lsn) {
+  pthread_mutex_lock(&wal->lock);
+  while (wal->synced_lsn < lsn && !wal->failed) {
+    if (wal->syncing) {
+      pthread_cond_wait(&wal->synced, &wal->lock);
+      continue;
+    }
+
+    uint8_t *batch = wal->buf;
+    size_t batch_size = wal->buf_size;
+    size_t batch_cap = wal->buf_cap;
+    uint64_t batch_lsn = wal->appended_lsn;
+    size_t batch_end = wal->end;
+
+    // Appenders fill the spare buffer while this batch is written
+    wal->buf = wal->spare;
+    wal->buf_cap = wal->spare_cap;
+    wal->buf_size = 0;
+    wal->spare = NULL;
+    wal->spare_cap = 0;
+    wal->syncing = true;
+    pthread_mutex_unlock(&wal->lock);
+
+    bool ok = write_all(wal->fd, batch, batch_size) && fdatasync(wal->fd) == 0;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->spare = batch;
+    wal->spare_cap = batch_cap;
+    wal->syncing = false;
+    if (ok) {
+      wal->synced_lsn = batch_lsn;
+      wal->synced_end = batch_end;
+      if (wal->checkpoint_bytes &&
+          wal->synced_end - wal->base >= wal->checkpoint_bytes)
+        pthread_cond_signal(&wal->wake);
+    } else {
+      wal->failed = true;
+      pthread_cond_signal(&wal->wake);
+    }
+    pthread_cond_broadcast(&wal->synced);
+  }
+
+  bool ok = wal->synced_lsn >= lsn;
+  pthread_mutex_unlock(&wal->lock);
+  return ok;
+}
+
+/*
+ * Re-adds a packed stream at its logged ref. Refs only grow, so one that is
+ * already taken (or whose block is gone) was covered by the last checkpoint.
+ */
+static bool wal_apply_packed_add(spdf_t *doc, const uint8_t *payload,
+                                 uint32_t size) {
+  if (size < WAL_PACKED_HEADER || size > WAL_PACKED_HEADER + PACKED_STREAM_MAX)
+    return false;
+
+  spdf_ref_t ref = wal_get_ref(payload);
+  int64_t when;
+  memcpy(&when, payload + WAL_REF, sizeof(when));
+  time_t created = (time_t)when;
+  uint8_t encoding = payload[WAL_REF + sizeof(when)];
+  uint8_t mime_type = payload[WAL_REF + sizeof(when) + 1];
+  size -= WAL_PACKED_HEADER;
+
+  pthread_mutex_lock(doc->lock);
+  spdf_block_t *block = NULL;
+  bool ok = true;
+  if (ref.block < doc->n_blocks) {
+    block = doc->blocks[ref.block];
+    if (!block || ref.index < block->n_entries) {
+      pthread_mutex_unlock(doc->lock);
+      return true;
+    }
+    ok = ref.index == block->n_entries && block_fits(block, size, created);
+  } else {
+    // Blocks skipped over were emptied and freed before the checkpoint
+    ok = ref.index == 0 && reserve_blocks(doc, (size_t)ref.block + 1) &&
+         (block = create_spdf_block());
+    if (ok) {
+      block->created = created;
+      while (doc->n_blocks < ref.block)
+        doc->blocks[doc->n_blocks++] = NULL;
+      doc->blocks[doc->n_blocks++] = block;
+    }
+  }
+
+  ok = ok && append_entry(block, payload + WAL_PACKED_HEADER, size, encoding,
+                          mime_type, created);
+  pthread_mutex_unlock(doc->lock);
+  return ok;
+}
+
+// Doubles the stream capacity when every slot is taken.
+static bool wal_make_room(spdf_t *doc) {
+  if (doc->n_streams < doc->max_streams && doc->streams &&
+      !doc->streams[doc->max_streams - 1])
+    return true;
+
+  size_t max_streams = doc->max_streams ? doc->max_streams * 2 : 16;
+  if (doc->index && !grow_spdf_index(doc->index, max_streams))
+    return false;
+
+  spdf_stream_t **streams = (spdf_stream_t **)realloc(
+      doc->streams, (max_streams + 1) * sizeof(spdf_stream_t *));
+  if (!streams)
+    return false;
+  memset(streams + doc->max_streams, 0,
+         (max_streams + 1 - doc->max_streams) * sizeof(spdf_stream_t *));
+
+  doc->streams = streams;
+  doc->max_streams = max_streams;
+  return true;
+}
+
+/*
+ * Applies one record. Stream ids are unique, so an add for a stream that is
+ * already present or a remove for one that is gone was covered by the last
+ * checkpoint and is skipped; this makes replay safe to repeat. Replay grows
+ * the document when the log holds more streams than it has room for.
+ */
+static bool wal_apply(spdf_t *doc, uint8_t op, uint8_t *payload,
+                      uint32_t size) {
+  if (op == WAL_REMOVE) {
+    if (size != ID_LEN)
+      return false;
+    size_t i = find_slot(doc, (const char *)payload);
+    return i == doc->max_streams || remove_stream(doc->streams[i], doc);
+  }
+
+  if (op == WAL_PACKED_ADD)
+    return wal_apply_packed_add(doc, payload, size);
+
+  // Fails only for a ref that is already gone
+  if (op == WAL_PACKED_REMOVE) {
+    if (size != WAL_REF)
+      return false;
+    remove_packed_stream(doc, wal_get_ref(payload));
+    return true;
+  }
+
+  if (op != WAL_ADD)
+    return false;
+
+  spdf_stream_t *stream = (spdf_stream_t *)calloc(1, sizeof(spdf_stream_t));
+  if (!stream)
+    return false;
+
+  FILE *mem = fmemopen(payload, size, "r");
+  bool ok = mem && deserialize_spdf_stream_t(stream, mem);
+  if (mem)
+    fclose(mem);
+
+  if (!ok || find_slot(doc, stream->id) != doc->max_streams) {
+    free(stream->data);
+    free(stream);
+    return ok;
+  }
+
+  pthread_mutex_lock(doc->lock);
+  ok = wal_make_room(doc);
+  pthread_mutex_unlock(doc->lock);
+  if (!ok) {
+    free(stream->data);
+    free(stream);
+    return false;
+  }
+
+  return insert_stream(stream, doc, false);
+}
+
+/*
+ * Replays every intact record and returns the length of the intact prefix.
+ * A record that cannot be applied is counted in skipped rather than making
+ * the rest of the log unrecoverable.
+ */
+static bool wal_replay(spdf_t *doc, int fd, size_t *valid, size_t *skipped) {
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return false;
+
+  size_t size = (size_t)st.st_size;
+  *valid = 0;
+  *skipped = 0;
+  if (size == 0)
+    return true;
+
+  uint8_t *log = (uint8_t *)malloc(size);
+  if (!log)
+    return false;
+  if (!read_all(fd, log, size, 0)) {
+    free(log);
+    return false;
+  }
+
+  size_t off = 0;
+  while (size - off >= WAL_HEADER + WAL_TRAILER) {
+    uint32_t len, sum;
+    memcpy(&len, log + off + sizeof(uint8_t), sizeof(len));
+    if (size - off - WAL_HEADER - WAL_TRAILER < len)
+      break;
+    memcpy(&sum, log + off + WAL_HEADER + len, sizeof(sum));
+    if (sum != wal_checksum(log + off, WAL_HEADER + len))
+      break;
+
+    if (!wal_apply(doc, log[off], log + off + WAL_HEADER, len))
+      (*skipped)++;
+    off += WAL_HEADER + len + WAL_TRAILER;
+  }
+
+  free(log);
+  *valid = off;
+  return true;
+}
+
+/*
+ * Replays the log at path into doc, drops any torn tail left by a crash, and
+ * attaches the log so later add_stream/remove_stream calls are recorded.
+ * Load the last checkpoint with load_spdf first, if there is one, or start
+ * from create_spdf. Records that cannot be applied are counted in
+ * wal->skipped.
+ */
+spdf_wal_t *open_spdf_wal(spdf_t *doc, const char *path) {
+  if (!doc || !path || doc->wal)
+    return NULL;
+
+  // A newly created log is only durable once its directory entry is
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+    return NULL;
+  if (!sync_parent(path)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t valid, skipped;
+  if (!wal_replay(doc, fd, &valid, &skipped)) {
+    close(fd);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      ((size_t)st.st_size > valid &&
+       (ftruncate(fd, (off_t)valid) != 0 || fdatasync(fd) != 0))) {
+    close(fd);
+    return NULL;
+  }
+
+  spdf_wal_t *wal = (spdf_wal_t *)calloc(1, sizeof(spdf_wal_t));
+  if (!wal) {
+    close(fd);
+    return NULL;
+  }
+
+  wal->path = strdup(path);
+  if (!wal->path || pthread_mutex_init(&wal->lock, NULL) != 0) {
+    free(wal->path);
+    free(wal);
+    close(fd);
+    return NULL;
+  }
+  if (pthread_mutex_init(&wal->checkpoint_lock, NULL) != 0) {
+    pthread_mutex_destroy(&wal->lock);
+    free(wal->path);
+    free(wal);
+    close(fd);
+    return NULL;
+  }
+  pthread_cond_init(&wal->synced, NULL);
+  pthread_cond_init(&wal->wake, NULL);
+
+  wal->fd = fd;
+  wal->synced_end = wal->end = valid;
+  wal->skipped = skipped;
+
+  pthread_mutex_lock(doc->lock);
+  doc->wal = wal;
+  pthread_mutex_unlock(doc->lock);
+  return wal;
+}
+
+/*
+ * Stops the checkpointer, syncs whatever is still buffered and detaches the
+ * log. No other thread may be mutating the document at the same time.
+ */
+bool close_spdf_wal(spdf_t *doc) {
+  if (!doc || !doc->wal)
+    return false;
+
+  spdf_wal_t *wal = doc->wal;
+
+  pthread_mutex_lock(&wal->lock);
+  bool running = wal->checkpointing;
+  wal->checkpointing = false;
+  pthread_cond_signal(&wal->wake);
+  pthread_mutex_unlock(&wal->lock);
+  if (running)
+    pthread_join(wal->checkpointer, NULL);
+
+  pthread_mutex_lock(doc->lock);
+  doc->wal = NULL;
+  pthread_mutex_unlock(doc->lock);
+
+  bool ok = sync_spdf_wal(wal, wal->appended_lsn);
+  ok = close(wal->fd) == 0 && ok;
+
+  pthread_cond_destroy(&wal->wake);
+  pthread_cond_destroy(&wal->synced);
+  pthread_mutex_destroy(&wal->checkpoint_lock);
+  pthread_mutex_destroy(&wal->lock);
+  free(wal->buf);
+  free(wal->spare);
+  free(wal->path);
+  free(wal->spdf_path);
+  free(wal);
+  return ok;
+}
+
+// Each writer gets its own temporary file, so concurrent ones never mix.
+static bool write_file(const char *path, const void *data, size_t size) {
+  size_t len = strlen(path);
+  char *tmp = (char *)malloc(len + sizeof(".XXXXXX"));
+  if (!tmp)
+    return false;
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    free(tmp);
+    return false;
+  }
+
+  bool ok = fchmod(fd, 0644) == 0 && write_all(fd, data, size) &&
+            fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp, path) == 0 && sync_parent(path);
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  return ok;
+}
+
+// Copies the log bytes in [from, to) from one descriptor to the end of another.
+static bool wal_copy(int from_fd, int to_fd, size_t from, size_t to) {
+  size_t size = to - from;
+  if (size == 0)
+    return true;
+
+  uint8_t *buf = (uint8_t *)malloc(size);
+  bool ok = buf && read_all(from_fd, buf, size, (off_t)from) &&
+            write_all(to_fd, buf, size);
+  free(buf);
+  return ok;
+}
+
+/*
+ * Drops the log up to the logical offset cut, keeping any later records.
+ * The caller holds checkpoint_lock. The kept tail is copied into a new file
+ * and synced without wal->lock, so appends and group commits carry on
+ * meanwhile. The lock is only taken to copy records synced during that time
+ * and to swap in the new file. The directory sync after the rename holds
+ * back syncing but not appends.
+ */
+static bool wal_trim(spdf_wal_t *wal, size_t cut) {
+  pthread_mutex_lock(&wal->lock);
+  size_t base = wal->base;
+  size_t copied = wal->synced_end;
+  pthread_mutex_unlock(&wal->lock);
+
+  if (cut <= base || cut > copied)
+    return cut <= base;
+
+  char *tmp = tmp_path(wal->path);
+  int fd = tmp ? open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644) : -1;
+
+  // Only trims move wal->fd, and the caller holds checkpoint_lock
+  bool ok = fd >= 0 &&
+            wal_copy(wal->fd, fd, cut - base, copied - base) &&
+            fdatasync(fd) == 0;
+
+  pthread_mutex_lock(&wal->lock);
+  while (wal->syncing)
+    pthread_cond_wait(&wal->synced, &wal->lock);
+
+  if (ok && wal->synced_end > copied)
+    ok = wal_copy(wal->fd, fd, copied - base, wal->synced_end - base) &&
+         fdatasync(fd) == 0;
+  ok = ok && rename(tmp, wal->path) == 0;
+  if (!ok) {
+    pthread_mutex_unlock(&wal->lock);
+    if (fd >= 0)
+      close(fd);
+    if (tmp)
+      unlink(tmp);
+    free(tmp);
+    return false;
+  }
+
+  close(wal->fd);
+  wal->fd = fd;
+  wal->base = cut;
+
+  // Records synced into the new file are not durable until the rename is
+  wal->syncing = true;
+  pthread_mutex_unlock(&wal->lock);
+
+  ok = sync_parent(wal->path);
+
+  pthread_mutex_lock(&wal->lock);
+  wal->syncing = false;
+  if (!ok) {
+    wal->failed = true;
+    pthread_cond_signal(&wal->wake);
+  }
+  pthread_cond_broadcast(&wal->synced);
+  pthread_mutex_unlock(&wal->lock);
+
+  free(tmp);
+  return ok;
+}
+
+/*
+ * Writes a snapshot of doc to path (via a temporary file and rename), then
+ * trims the records it covers from the attached log. Ingest is only blocked
+ * while the snapshot is serialized into memory. Checkpoints of one log run
+ * one at a time, so an older snapshot can never replace a newer one whose
+ * records were already trimmed. Nothing is written once the log has failed.
+ */
+bool checkpoint_spdf(spdf_t *doc, const char *path) {
+  pthread_mutex_lock(doc->lock);
+  spdf_wal_t *wal = doc->wal;
+  pthread_mutex_unlock(doc->lock);
+
+  if (wal) {
+    pthread_mutex_lock(&wal->checkpoint_lock);
+    pthread_mutex_lock(&wal->lock);
+    bool failed = wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    if (failed) {
+      pthread_mutex_unlock(&wal->checkpoint_lock);
+      return false;
+    }
+  }
+
+  char *snapshot = NULL;
+  size_t size = 0;
+  FILE *mem = open_memstream(&snapshot, &size);
+  if (!mem) {
+    if (wal)
+      pthread_mutex_unlock(&wal->checkpoint_lock);
+    return false;
+  }
+
+  pthread_mutex_lock(doc->lock);
+  bool ok = save_spdf(doc, mem);
+  size_t cut = 0;
+  uint64_t lsn = 0;
+  if (wal) {
+    pthread_mutex_lock(&wal->lock);
+    cut = wal->end;
+    lsn = wal->appended_lsn;
+    // A snapshot from before the last trim would lose the records since
+    ok = ok && cut >= wal->base;
+    pthread_mutex_unlock(&wal->lock);
+  }
+  pthread_mutex_unlock(doc->lock);
+
+  ok = fclose(mem) == 0 && ok;
+  ok = ok && write_file(path, snapshot, size);
+  free(snapshot);
+  if (!wal)
+    return ok;
+
+  // Records up to cut are in the snapshot; they must be on disk to be trimmed
+  ok = ok && sync_spdf_wal(wal, lsn) && wal_trim(wal, cut);
+  pthread_mutex_unlock(&wal->checkpoint_lock);
+  return ok;
+}
+
+static void *checkpoint_worker(void *arg) {
+  spdf_t *doc = (spdf_t *)arg;
+  spdf_wal_t *wal = doc->wal;
+
+  // A failed log takes no more records, so there is nothing left to trim
+  pthread_mutex_lock(&wal->lock);
+  while (wal->checkpointing && !wal->failed) {
+    if (wal->synced_end - wal->base < wal->checkpoint_bytes) {
+      pthread_cond_wait(&wal->wake, &wal->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    bool ok = checkpoint_spdf(doc, wal->spdf_path);
+
+    pthread_mutex_lock(&wal->lock);
+    if (!ok && wal->checkpointing) {
+      // Back off instead of spinning on a persistent error
+      struct timespec retry;
+      clock_gettime(CLOCK_REALTIME, &retry);
+      retry.tv_sec += 1;
+      pthread_cond_timedwait(&wal->wake, &wal->lock, &retry);
+    }
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return NULL;
+}
+
+/*
+ * Checkpoints doc into path on a background thread whenever the attached log
+ * grows past wal_bytes. The thread stops in close_spdf_wal.
+ */
+bool start_spdf_checkpointer(spdf_t *doc, const char *path, size_t wal_bytes) {
+  if (!doc || !doc->wal || !path || wal_bytes == 0)
+    return false;
+
+  spdf_wal_t *wal = doc->wal;
+  char *spdf_path = strdup(path);
+  if (!spdf_path)
+    return false;
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->checkpointing) {
+    pthread_mutex_unlock(&wal->lock);
+    free(spdf_path);
+    return false;
+  }
+  free(wal->spdf_path);
+  wal->spdf_path = spdf_path;
+  wal->checkpoint_bytes = wal_bytes;
+  wal->checkpointing = true;
+
+  if (pthread_create(&wal->checkpointer, NULL, checkpoint_worker, doc) != 0) {
+    wal->checkpointing = false;
+    pthread_mutex_unlock(&wal->lock);
+    return false;
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return true;
+}
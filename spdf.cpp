@@ -160,6 +160,9 @@ void SPDF::removeStream(const std::string &key) {
   if (xref_table.find(key) != xref_table.end()) {
     size_t index = xref_table[key];
     if (index < streams.size()) {
+      const auto &victim = streams[index];
+      format_index[victim->format].erase(victim->uuid);
+      encoding_index[victim->encoding].erase(victim->uuid);
       streams.erase(streams.begin() + index);
       xref_table.erase(key);
       for (auto &pair : xref_table) {
@@ -171,6 +174,40 @@ void SPDF::removeStream(const std::string &key) {
   }
 }
 
+// Returns the ids of streams matching both filters; an empty filter matches
+// any value.
+std::vector<std::string> SPDF::queryStreams(const std::string &format,
+                                            const std::string &encoding) const {
+  static const std::set<std::string> none;
+  auto lookup = [](const std::map<std::string, std::set<std::string>> &index,
+                   const std::string &key) -> const std::set<std::string> & {
+    auto it = index.find(key);
+    return it == index.end() ? none : it->second;
+  };
+
+  std::vector<std::string> ids;
+  if (format.empty() && encoding.empty()) {
+    for (const auto &s : streams)
+      ids.push_back(s->uuid);
+    return ids;
+  }
+
+  if (format.empty()) {
+    const auto &by_encoding = lookup(encoding_index, encoding);
+    return {by_encoding.begin(), by_encoding.end()};
+  }
+
+  const auto &by_format = lookup(format_index, format);
+  if (encoding.empty())
+    return {by_format.begin(), by_format.end()};
+
+  const auto &by_encoding = lookup(encoding_index, encoding);
+  for (const auto &id : by_format)
+    if (by_encoding.count(id))
+      ids.push_back(id);
+  return ids;
+}
+
 void SPDF::_addStream(std::unique_ptr<DataStream> stream) {
   if (_curr_read_idx == 0)
     stream->offset = 67;
@@ -182,5 +219,7 @@ void SPDF::_addStream(std::unique_ptr<DataStream> stream) {
   stream->reading_index = _curr_read_idx++;
   updated = stopwatch::add_timestamp();
   xref_table[stream->uuid] = stream->offset;
+  format_index[stream->format].insert(stream->uuid);
+  encoding_index[stream->encoding].insert(stream->uuid);
   streams.push_back(std::move(stream));
 }
@@ -2,6 +2,7 @@
 #define SPDF_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,6 +15,8 @@
 #define VERSION_LEN 12
 #define ID_CHARS "0123456789ABCDEFGHIJKLMNOPQRSATUVWXYZ"
 #define ID_LEN 36
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 64
 
 #define WRITE_AND_CHECK(stream, member, out) \
   do { \
@@ -50,6 +53,178 @@ typedef struct {
   void *data;
 } spdf_stream_t;
 
+/*
+ * Decoded payloads are cached per stream id. A cache entry returned by
+ * spdf_cache_get is pinned and stays valid until spdf_cache_release, even if
+ * it is evicted or invalidated in the meantime. The byte budget is shared by
+ * all shards, so one hot stream may use all of it.
+ */
+typedef bool (*spdf_decode_fn)(const spdf_stream_t *stream, void **out,
+                               size_t *out_size);
+
+typedef struct spdf_cache_entry {
+  char id[ID_LEN];
+  void *data;
+  size_t data_size;
+  size_t pins;
+  bool stale;
+  bool uncounted; // larger than the whole budget, never cached
+  struct spdf_cache_entry *prev;  // LRU list, most recent first
+  struct spdf_cache_entry *next;
+  struct spdf_cache_entry *chain; // hash bucket
+} spdf_cache_entry_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t bytes;
+  size_t n_entries;
+  spdf_cache_entry_t *buckets[CACHE_BUCKETS];
+  spdf_cache_entry_t *head;
+  spdf_cache_entry_t *tail;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t generation; // bumped by every invalidation in this shard
+} spdf_cache_shard_t;
+
+typedef struct {
+  size_t budget;
+  atomic_size_t bytes;
+  atomic_size_t hand; // next shard to evict from when over budget
+  size_t n_shards;
+  spdf_decode_fn decode;
+  spdf_cache_shard_t *shards;
+} spdf_cache_t;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t bytes;
+  size_t n_entries;
+} spdf_cache_stats_t;
+
+/*
+ * Secondary indexes over stream slots: one bitmap per value of each
+ * categorical header field, plus slots sorted by created/updated time.
+ * Bitmaps are allocated on first use of a value.
+ */
+enum index_attr {
+  INDEX_STREAM_TYPE = 0,
+  INDEX_ENCODING,
+  INDEX_MIME_TYPE,
+  INDEX_COMPRESSION,
+  INDEX_ATTRS
+};
+#define INDEX_VALUES 256
+
+/*
+ * Small streams are packed into blocks: a header, a table of 12-byte
+ * entries and the payloads stored back to back. A packed stream is
+ * addressed by its (block, index) reference rather than by an id, and
+ * carries no version, position or reading index of its own.
+ *
+ * Packed streams are not in doc->streams, so query_streams and the
+ * secondary indexes, the payload cache and print_spdf do not see them.
+ * They are only reachable through read_packed_stream.
+ */
+#define BLOCK_ENTRIES 256
+#define BLOCK_PAYLOAD_MAX UINT16_MAX
+#define PACKED_STREAM_MAX UINT8_MAX
+
+typedef struct {
+  uint32_t created; // seconds after the block was created
+  uint16_t offset;  // into the block payload
+  uint8_t size;
+  uint8_t encoding;
+  uint8_t mime_type;
+  uint8_t compression;
+  uint8_t live;
+  uint8_t reserved;
+} spdf_block_entry_t;
+
+typedef struct {
+  time_t created;
+  uint16_t n_entries;
+  uint16_t n_live;
+  uint16_t n_pending; // removals waiting for their WAL sync
+  uint32_t payload_size;
+  uint32_t payload_cap;
+  spdf_block_entry_t entries[BLOCK_ENTRIES];
+  uint8_t *payload;
+} spdf_block_t;
+
+typedef struct {
+  uint32_t block;
+  uint16_t index;
+} spdf_ref_t;
+
+typedef struct {
+  time_t time;
+  size_t slot;
+} spdf_time_entry_t;
+
+typedef struct {
+  size_t n_slots;
+  size_t n_words;
+  uint64_t *live;
+  uint64_t *bitmaps[INDEX_ATTRS][INDEX_VALUES];
+  size_t n_entries;
+  spdf_time_entry_t *by_created;
+  spdf_time_entry_t *by_updated;
+} spdf_index_t;
+
+/*
+ * Categorical fields set to -1 match any value. Time bounds are half-open,
+ * [after, before), and a bound of 0 is unbounded.
+ */
+typedef struct {
+  int stream_type;
+  int encoding;
+  int mime_type;
+  int compression;
+  time_t created_after;
+  time_t created_before;
+  time_t updated_after;
+  time_t updated_before;
+} spdf_query_t;
+
+/*
+ * Append-only log of add_stream/remove_stream and add_packed_stream/
+ * remove_packed_stream calls. Records are buffered in memory and made
+ * durable by whichever caller syncs first, so concurrent mutations share one
+ * write and one fdatasync. Offsets are logical: they keep counting across
+ * checkpoints, and base is the offset of the first byte still in the file.
+ */
+enum wal_op { WAL_ADD = 1, WAL_REMOVE, WAL_PACKED_ADD, WAL_PACKED_REMOVE };
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+  int fd;
+  char *path;
+  uint8_t *buf;
+  size_t buf_size;
+  size_t buf_cap;
+  uint8_t *spare;
+  size_t spare_cap;
+  uint64_t appended_lsn;
+  uint64_t synced_lsn;
+  size_t base;
+  size_t synced_end;
+  size_t end;
+  bool syncing;
+  bool failed;
+  size_t skipped; // records replay could not apply
+  // checkpointing; checkpoint_lock serializes snapshot, write and trim
+  pthread_mutex_t checkpoint_lock;
+  pthread_cond_t wake;
+  pthread_t checkpointer;
+  bool checkpointing;
+  size_t checkpoint_bytes;
+  char *spdf_path;
+} spdf_wal_t;
+
 typedef struct {
   pthread_mutex_t *lock;
   char version[VERSION_LEN];
@@ -60,6 +235,13 @@ typedef struct {
   size_t n_streams;
   size_t max_streams;
   spdf_stream_t **streams;
+  spdf_cache_t *cache;
+  spdf_index_t *index;
+  bool persist_index;
+  size_t n_blocks;
+  size_t max_blocks;
+  spdf_block_t **blocks;
+  spdf_wal_t *wal;
 } spdf_t;
 
 char *generate_id(void);
@@ -72,10 +254,50 @@ bool serialize_spdf_stream_t(const spdf_stream_t *stream, FILE *out);
 bool deserialize_spdf_stream_t(spdf_stream_t *stream, FILE *in);
 spdf_t *create_spdf(size_t max_elements);
 bool destroy_spdf(spdf_t *doc);
+/*
+ * add_stream takes ownership of stream. With a WAL attached, add_stream and
+ * remove_stream return true only once the change is durable. On false the
+ * document is left as it was, but a record that reached the disk before the
+ * sync failed may still be replayed on recovery.
+ */
 bool add_stream(spdf_stream_t *stream, spdf_t *doc);
 bool remove_stream(spdf_stream_t *stream, spdf_t *doc);
 bool save_spdf(const spdf_t *document, FILE *out);
+bool save_spdf_parallel(const spdf_t *document, FILE *out, size_t n_threads);
 bool load_spdf(spdf_t *document, FILE *in);
 void print_spdf(spdf_t *doc);
+spdf_cache_t *create_spdf_cache(size_t budget, size_t n_shards,
+                                spdf_decode_fn decode);
+bool destroy_spdf_cache(spdf_cache_t *cache);
+spdf_cache_entry_t *spdf_cache_get(spdf_t *doc, const char *id);
+void spdf_cache_release(spdf_cache_t *cache, spdf_cache_entry_t *entry);
+bool spdf_cache_invalidate(spdf_cache_t *cache, const char *id);
+void spdf_cache_clear(spdf_cache_t *cache);
+void spdf_cache_stats(spdf_cache_t *cache, spdf_cache_stats_t *stats);
+spdf_index_t *create_spdf_index(size_t n_slots);
+bool destroy_spdf_index(spdf_index_t *index);
+bool index_add_stream(spdf_index_t *index, const spdf_stream_t *stream,
+                      size_t slot);
+bool index_remove_stream(spdf_index_t *index, const spdf_stream_t *stream,
+                         size_t slot);
+size_t query_streams(spdf_t *doc, const spdf_query_t *query,
+                     spdf_stream_t **out, size_t max_out);
+spdf_index_t *compact_spdf_index(const spdf_t *doc);
+bool save_spdf_index(const spdf_index_t *index, FILE *out);
+spdf_index_t *load_spdf_index(FILE *in);
+spdf_block_t *create_spdf_block(void);
+bool destroy_spdf_block(spdf_block_t *block);
+bool add_packed_stream(spdf_t *doc, const void *data, size_t size,
+                       uint8_t encoding, uint8_t mime_type, spdf_ref_t *ref);
+bool remove_packed_stream(spdf_t *doc, spdf_ref_t ref);
+bool read_packed_stream(spdf_t *doc, spdf_ref_t ref, void *buf, size_t cap,
+                        size_t *size);
+bool save_spdf_blocks(const spdf_t *document, FILE *out);
+bool load_spdf_blocks(spdf_t *document, FILE *in);
+spdf_wal_t *open_spdf_wal(spdf_t *doc, const char *path);
+bool close_spdf_wal(spdf_t *doc);
+bool sync_spdf_wal(spdf_wal_t *wal, uint64_t lsn);
+bool checkpoint_spdf(spdf_t *doc, const char *path);
+bool start_spdf_checkpointer(spdf_t *doc, const char *path, size_t wal_bytes);
 
 #endif // SPDF_H
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -41,6 +42,8 @@ public:
   std::string created;
   std::string updated;
   std::map<std::string, size_t> xref_table;
+  std::map<std::string, std::set<std::string>> format_index;
+  std::map<std::string, std::set<std::string>> encoding_index;
   std::vector<std::unique_ptr<DataStream>> streams;
 
   SPDF();
@@ -53,6 +56,8 @@ public:
                  const std::array<double, 2> &position,
                  const std::vector<uint8_t> &data);
   void removeStream(const std::string &key);
+  std::vector<std::string> queryStreams(const std::string &format,
+                                        const std::string &encoding) const;
 
 private:
   std::size_t _curr_read_idx = 0;
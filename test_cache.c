@@ -0,0 +1,164 @@
+#include "spdf.h"
+#include "test.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_STREAMS 256
+#define PAYLOAD 100
+#define N_READERS 4
+#define READS 20000
+
+static spdf_t *doc;
+static char ids[N_STREAMS][ID_LEN];
+
+/*
+ * Stream i's payload is the byte i + 1 repeated, so a mixed-up entry shows.
+ * It ends in a NUL because add_stream prints payloads as strings.
+ */
+static bool payload_ok(const spdf_cache_entry_t *entry, size_t i,
+                       size_t size) {
+  if (entry->data_size != size)
+    return false;
+  for (size_t k = 0; k < size; k++)
+    if (((uint8_t *)entry->data)[k] !=
+        (k % PAYLOAD == PAYLOAD - 1 ? 0 : (uint8_t)(i + 1)))
+      return false;
+  return true;
+}
+
+// Decodes to twice the stored size by repeating the payload.
+static bool decode_twice(const spdf_stream_t *stream, void **out,
+                         size_t *out_size) {
+  *out_size = 2 * stream->data_size;
+  *out = malloc(*out_size);
+  if (!*out)
+    return false;
+  memcpy(*out, stream->data, stream->data_size);
+  memcpy((char *)*out + stream->data_size, stream->data, stream->data_size);
+  return true;
+}
+
+static void fill_document(size_t n_streams) {
+  uint8_t payload[PAYLOAD];
+  for (size_t i = 0; i < n_streams; i++) {
+    memset(payload, (int)(i + 1), sizeof(payload) - 1);
+    payload[PAYLOAD - 1] = 0;
+    spdf_stream_t *stream = create_stream(payload, sizeof(payload));
+    CHECK(stream && add_stream(stream, doc));
+    memcpy(ids[i], stream->id, ID_LEN);
+  }
+}
+
+// The byte budget is shared by every shard and never exceeded at rest.
+static void test_budget(void) {
+  doc = create_spdf(N_STREAMS);
+  CHECK(doc);
+  fill_document(N_STREAMS);
+  doc->cache = create_spdf_cache(10 * PAYLOAD, 16, NULL);
+  CHECK(doc->cache);
+
+  for (int round = 0; round < 2; round++) {
+    for (size_t i = 0; i < N_STREAMS; i++) {
+      spdf_cache_entry_t *entry = spdf_cache_get(doc, ids[i]);
+      CHECK(entry && payload_ok(entry, i, PAYLOAD));
+      spdf_cache_release(doc->cache, entry);
+    }
+  }
+
+  // The most recent streams fit, whichever shard they hash to
+  spdf_cache_stats_t stats;
+  spdf_cache_stats(doc->cache, &stats);
+  CHECK(stats.bytes <= 10 * PAYLOAD && stats.n_entries == 10);
+  CHECK(stats.hits + stats.misses == 2 * N_STREAMS && stats.evictions > 0);
+
+  uint64_t hits = stats.hits;
+  spdf_cache_entry_t *hot = spdf_cache_get(doc, ids[N_STREAMS - 1]);
+  spdf_cache_stats(doc->cache, &stats);
+  CHECK(hot && stats.hits == hits + 1);
+
+  // A pinned entry outlives the removal of its stream
+  CHECK(remove_stream(doc->streams[N_STREAMS + 1], doc));
+  CHECK(payload_ok(hot, N_STREAMS - 1, PAYLOAD));
+  spdf_cache_release(doc->cache, hot);
+  CHECK(spdf_cache_get(doc, ids[N_STREAMS - 1]) == NULL);
+
+  destroy_spdf_cache(doc->cache);
+  doc->cache = NULL;
+  destroy_spdf(doc);
+}
+
+static void test_decode(void) {
+  doc = create_spdf(4);
+  CHECK(doc);
+  fill_document(4);
+  doc->cache = create_spdf_cache(1024, 0, decode_twice);
+  CHECK(doc->cache);
+
+  spdf_cache_entry_t *entry = spdf_cache_get(doc, ids[3]);
+  CHECK(entry && payload_ok(entry, 3, 2 * PAYLOAD));
+  spdf_cache_release(doc->cache, entry);
+
+  destroy_spdf_cache(doc->cache);
+  doc->cache = NULL;
+  destroy_spdf(doc);
+}
+
+static void *read_streams(void *arg) {
+  unsigned seed = (unsigned)(size_t)arg;
+  for (int r = 0; r < READS; r++) {
+    size_t i = (size_t)rand_r(&seed) % N_STREAMS;
+    spdf_cache_entry_t *entry = spdf_cache_get(doc, ids[i]);
+    if (!entry)
+      continue; // removed
+    CHECK(payload_ok(entry, i, PAYLOAD));
+    spdf_cache_release(doc->cache, entry);
+  }
+  return NULL;
+}
+
+/*
+ * Readers hammer the cache while every other stream is removed; no reader
+ * may see a wrong payload and no removed stream may stay cached.
+ */
+static void test_concurrent_remove(void) {
+  doc = create_spdf(N_STREAMS);
+  CHECK(doc);
+  fill_document(N_STREAMS);
+  doc->cache = create_spdf_cache(64 * PAYLOAD, 8, NULL);
+  CHECK(doc->cache);
+
+  pthread_t readers[N_READERS];
+  for (size_t t = 0; t < N_READERS; t++)
+    CHECK(pthread_create(&readers[t], NULL, read_streams, (void *)(t + 1)) ==
+          0);
+  for (size_t i = 0; i < N_STREAMS; i += 2)
+    CHECK(remove_stream(doc->streams[i + 2], doc));
+  for (size_t t = 0; t < N_READERS; t++)
+    pthread_join(readers[t], NULL);
+
+  for (size_t i = 0; i < N_STREAMS; i++) {
+    spdf_cache_entry_t *entry = spdf_cache_get(doc, ids[i]);
+    CHECK((entry == NULL) == (i % 2 == 0));
+    spdf_cache_release(doc->cache, entry);
+  }
+
+  spdf_cache_stats_t stats;
+  spdf_cache_stats(doc->cache, &stats);
+  CHECK(stats.bytes <= 64 * PAYLOAD);
+  printf("\ncache: %llu hits, %llu misses, %llu evictions\n",
+         (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+         (unsigned long long)stats.evictions);
+
+  destroy_spdf_cache(doc->cache);
+  doc->cache = NULL;
+  destroy_spdf(doc);
+}
+
+int main(void) {
+  test_budget();
+  test_decode();
+  test_concurrent_remove();
+  puts("✔️");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#include "spdf.h"
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_STREAMS 500
+#define N_QUERIES 2000
+#define BASE_TIME 1000000
+
+// The answer query_streams must give, found by checking every slot.
+static size_t scan(const spdf_t *doc, const spdf_query_t *q,
+                   spdf_stream_t **out) {
+  size_t n = 0;
+  for (size_t i = 0; i < doc->max_streams; i++) {
+    const spdf_stream_t *s = doc->streams[i];
+    if (!s || !*s->id)
+      continue;
+    if ((q->stream_type >= 0 && s->stream_type != q->stream_type) ||
+        (q->encoding >= 0 && s->encoding != q->encoding) ||
+        (q->mime_type >= 0 && s->mime_type != q->mime_type) ||
+        (q->compression >= 0 && s->compression != q->compression))
+      continue;
+    if (s->created < q->created_after ||
+        (q->created_before && s->created >= q->created_before) ||
+        s->updated < q->updated_after ||
+        (q->updated_before && s->updated >= q->updated_before))
+      continue;
+    out[n++] = doc->streams[i];
+  }
+  return n;
+}
+
+static time_t random_time(void) {
+  return rand() % 4 ? BASE_TIME + rand() % 120 : 0;
+}
+
+static void compare_queries(spdf_t *doc) {
+  static spdf_stream_t *expected[N_STREAMS + 2], *got[N_STREAMS + 2];
+
+  for (int i = 0; i < N_QUERIES; i++) {
+    spdf_query_t q = {
+        .stream_type = rand() % 3 ? -1 : DATA_STREAM + rand() % 2,
+        .encoding = rand() % 2 ? -1 : rand() % 2,
+        .mime_type = rand() % 2 ? -1 : rand() % 2,
+        .compression = rand() % 2 ? -1 : rand() % 3,
+        .created_after = random_time(),
+        .created_before = random_time(),
+        .updated_after = random_time(),
+        .updated_before = random_time(),
+    };
+    size_t n = scan(doc, &q, expected);
+    CHECK(query_streams(doc, &q, got, N_STREAMS + 2) == n);
+    CHECK(!memcmp(got, expected, n * sizeof(*got)));
+  }
+}
+
+int main(void) {
+  srand(1);
+  spdf_t *doc = create_spdf(N_STREAMS);
+  CHECK(doc);
+
+  char payload[] = "indexed";
+  for (int i = 0; i < N_STREAMS; i++) {
+    spdf_stream_t *stream = create_stream(payload, sizeof(payload));
+    CHECK(stream);
+    stream->mime_type = rand() % 2;
+    stream->compression = rand() % 3;
+    stream->created = BASE_TIME + rand() % 100;
+    stream->updated = stream->created + rand() % 20;
+    CHECK(add_stream(stream, doc));
+  }
+  for (size_t i = 2; i < doc->max_streams; i += 5)
+    CHECK(remove_stream(doc->streams[i], doc));
+  compare_queries(doc);
+
+  // The persisted index was saved with slots renumbered past the removals
+  doc->persist_index = true;
+  FILE *file = tmpfile();
+  CHECK(file && save_spdf(doc, file));
+  rewind(file);
+  spdf_t *loaded = create_spdf(1);
+  CHECK(loaded && load_spdf(loaded, file));
+  CHECK(loaded->index->n_entries == loaded->n_streams);
+  compare_queries(loaded);
+  printf("\nindex: %d queries matched a full scan\n", 2 * N_QUERIES);
+
+  fclose(file);
+  destroy_spdf(loaded);
+  destroy_spdf(doc);
+  puts("✔️");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+#include "spdf.h"
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N_STREAMS 300
+#define N_PACKED 600
+
+// Reads the whole of a file written through out back into memory.
+static char *slurp(FILE *out, size_t *size) {
+  CHECK(fflush(out) == 0 && fseek(out, 0, SEEK_END) == 0);
+  long end = ftell(out);
+  CHECK(end > 0);
+  rewind(out);
+
+  char *data = malloc((size_t)end);
+  CHECK(data && fread(data, (size_t)end, 1, out) == 1);
+  *size = (size_t)end;
+  return data;
+}
+
+/*
+ * A document with removed slots, a freed and a half-empty packed block and a
+ * persisted index, large enough for several save workers to run.
+ */
+static spdf_t *build_document(void) {
+  spdf_t *doc = create_spdf(N_STREAMS);
+  CHECK(doc);
+
+  char payload[32];
+  for (int i = 0; i < N_STREAMS; i++) {
+    int len = snprintf(payload, sizeof(payload), "stream %d", i);
+    spdf_stream_t *stream = create_stream(payload, (size_t)len + 1);
+    CHECK(stream);
+    stream->mime_type = i % 3 ? TEXT : BINARY;
+    CHECK(add_stream(stream, doc));
+  }
+  for (size_t i = 2; i < doc->max_streams; i += 7)
+    CHECK(remove_stream(doc->streams[i], doc));
+
+  spdf_ref_t refs[N_PACKED];
+  for (int i = 0; i < N_PACKED; i++)
+    CHECK(add_packed_stream(doc, &i, sizeof(i), UTF8, BINARY, &refs[i]));
+  for (int i = 0; i < BLOCK_ENTRIES; i++)
+    CHECK(remove_packed_stream(doc, refs[i]));
+  for (int i = BLOCK_ENTRIES; i < N_PACKED; i += 3)
+    CHECK(remove_packed_stream(doc, refs[i]));
+  CHECK(doc->blocks[0] == NULL);
+
+  doc->persist_index = true;
+  return doc;
+}
+
+int main(void) {
+  spdf_t *doc = build_document();
+
+  FILE *serial = tmpfile();
+  CHECK(serial && save_spdf(doc, serial));
+  size_t serial_size;
+  char *expected = slurp(serial, &serial_size);
+
+  const size_t n_threads[] = {1, 2, 4, 0};
+  for (size_t t = 0; t < sizeof(n_threads) / sizeof(n_threads[0]); t++) {
+    FILE *parallel = tmpfile();
+    CHECK(parallel && save_spdf_parallel(doc, parallel, n_threads[t]));
+    size_t size;
+    char *data = slurp(parallel, &size);
+    CHECK(size == serial_size && !memcmp(data, expected, size));
+    free(data);
+    fclose(parallel);
+  }
+
+  // The file loads back with every stream and the index
+  rewind(serial);
+  spdf_t *loaded = create_spdf(1);
+  CHECK(loaded && load_spdf(loaded, serial));
+  CHECK(loaded->n_streams == doc->n_streams && loaded->index);
+  CHECK(loaded->index->n_entries == doc->index->n_entries);
+  printf("\nsave: %zu bytes, parallel output identical\n", serial_size);
+
+  free(expected);
+  fclose(serial);
+  destroy_spdf(loaded);
+  destroy_spdf(doc);
+  puts("✔️");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+#include "spdf.h"
+#include "test.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define N_THREADS 4
+#define PER_THREAD 200
+#define CRASH_AFTER (N_THREADS * PER_THREAD / 2)
+
+typedef struct {
+  spdf_t *doc;
+  int thread;
+  int acks; // write end of a pipe for ids of durable streams, or -1
+} ingest_t;
+
+static atomic_int n_acked;
+static char wal_path[64], spdf_path[64], copy_path[64];
+
+static void *ingest(void *arg) {
+  ingest_t *job = (ingest_t *)arg;
+  char payload[32];
+
+  for (int i = 0; i < PER_THREAD; i++) {
+    int len = snprintf(payload, sizeof(payload), "t%d-%d", job->thread, i);
+    spdf_stream_t *stream = create_stream(payload, (size_t)len + 1);
+    CHECK(stream && add_stream(stream, job->doc));
+    if (job->acks < 0)
+      continue;
+
+    // add_stream only returned once the record was durable
+    CHECK(write(job->acks, stream->id, ID_LEN) == ID_LEN);
+    if (atomic_fetch_add(&n_acked, 1) + 1 == CRASH_AFTER)
+      _exit(EXIT_SUCCESS);
+  }
+  return NULL;
+}
+
+static void run_ingest(spdf_t *doc, int acks) {
+  pthread_t threads[N_THREADS];
+  ingest_t jobs[N_THREADS];
+
+  for (int t = 0; t < N_THREADS; t++) {
+    jobs[t] = (ingest_t){.doc = doc, .thread = t, .acks = acks};
+    CHECK(pthread_create(&threads[t], NULL, ingest, &jobs[t]) == 0);
+  }
+  for (int t = 0; t < N_THREADS; t++)
+    pthread_join(threads[t], NULL);
+}
+
+static spdf_t *recover(const char *log) {
+  spdf_t *doc = create_spdf(1);
+  CHECK(doc);
+
+  FILE *in = fopen(spdf_path, "r");
+  if (in) {
+    CHECK(load_spdf(doc, in));
+    fclose(in);
+  }
+  CHECK(open_spdf_wal(doc, log) && doc->wal->skipped == 0);
+  return doc;
+}
+
+static bool has_stream(const spdf_t *doc, const char *id) {
+  for (size_t i = 0; i < doc->max_streams; i++)
+    if (doc->streams[i] && !strncmp(doc->streams[i]->id, id, ID_LEN))
+      return true;
+  return false;
+}
+
+// Copies from into to, or appends it when mode is "a".
+static void copy_file(const char *from, const char *to, const char *mode) {
+  FILE *in = fopen(from, "r");
+  FILE *out = fopen(to, mode);
+  CHECK(in && out);
+
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    CHECK(fwrite(buf, 1, n, out) == n);
+  fclose(in);
+  CHECK(fclose(out) == 0);
+}
+
+/*
+ * A child process ingests from several threads while a background
+ * checkpointer trims the log, and dies without closing anything halfway
+ * through. Every stream it was told is durable must come back.
+ */
+static void test_crash_recovery(void) {
+  int acks[2];
+  CHECK(pipe(acks) == 0);
+
+  pid_t child = fork();
+  CHECK(child >= 0);
+  if (child == 0) {
+    close(acks[0]);
+    spdf_t *doc = create_spdf(N_THREADS * PER_THREAD);
+    CHECK(doc && open_spdf_wal(doc, wal_path));
+    CHECK(start_spdf_checkpointer(doc, spdf_path, 16 * 1024));
+    run_ingest(doc, acks[1]);
+    _exit(EXIT_FAILURE);
+  }
+
+  close(acks[1]);
+  char (*ids)[ID_LEN] = calloc(N_THREADS * PER_THREAD, ID_LEN);
+  CHECK(ids);
+  size_t n_ids = 0;
+  while (n_ids < N_THREADS * PER_THREAD &&
+         read(acks[0], ids[n_ids], ID_LEN) == ID_LEN)
+    n_ids++;
+  close(acks[0]);
+
+  int status;
+  CHECK(waitpid(child, &status, 0) == child);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+  // Other threads may have been acknowledged while the crash was under way
+  CHECK(n_ids >= CRASH_AFTER);
+
+  spdf_t *doc = recover(wal_path);
+  for (size_t i = 0; i < n_ids; i++)
+    CHECK(has_stream(doc, ids[i]));
+  printf("\ncrash: %zu acknowledged, %zu recovered\n", n_ids,
+         doc->n_streams - 2);
+
+  free(ids);
+  destroy_spdf(doc);
+}
+
+/*
+ * Replaying a log that was never trimmed over a checkpoint must skip what
+ * the checkpoint already holds and leave the same document.
+ */
+static void test_full_replay(void) {
+  unlink(spdf_path);
+  unlink(wal_path);
+
+  spdf_t *doc = create_spdf(N_THREADS * PER_THREAD + 1);
+  CHECK(doc && open_spdf_wal(doc, wal_path));
+  run_ingest(doc, -1);
+  CHECK(remove_stream(doc->streams[2], doc));
+
+  CHECK(sync_spdf_wal(doc->wal, doc->wal->appended_lsn));
+  copy_file(wal_path, copy_path, "w");
+  CHECK(checkpoint_spdf(doc, spdf_path));
+
+  char last[] = "last";
+  CHECK(add_stream(create_stream(last, sizeof(last)), doc));
+  CHECK(close_spdf_wal(doc));
+
+  // The full log followed by what was logged after the checkpoint
+  copy_file(wal_path, copy_path, "a");
+
+  spdf_t *replayed = recover(copy_path);
+  CHECK(replayed->n_streams == doc->n_streams);
+  for (size_t i = 0; i < doc->max_streams; i++)
+    if (doc->streams[i] && *doc->streams[i]->id)
+      CHECK(has_stream(replayed, doc->streams[i]->id));
+  printf("\nreplay: %zu streams after replaying the full log\n",
+         replayed->n_streams - 2);
+
+  destroy_spdf(replayed);
+  destroy_spdf(doc);
+}
+
+#define N_PACKED 1500
+#define PACKED_SPLIT 700
+
+// Stream i is removed if it is in the first block or every seventh after it.
+static bool packed_live(int i) {
+  return i >= BLOCK_ENTRIES && i % 7 != 3;
+}
+
+static void check_packed(spdf_t *doc, const spdf_ref_t *refs) {
+  for (int i = 0; i < N_PACKED; i++) {
+    int value;
+    size_t size;
+    bool found = read_packed_stream(doc, refs[i], &value, sizeof(value), &size);
+    CHECK(found == packed_live(i));
+    CHECK(!found || (size == sizeof(value) && value == i));
+  }
+}
+
+static spdf_t *recover_packed(const char *log, bool from_checkpoint) {
+  spdf_t *doc = create_spdf(1);
+  CHECK(doc);
+  if (from_checkpoint) {
+    FILE *in = fopen(spdf_path, "r");
+    CHECK(in && load_spdf(doc, in));
+    fclose(in);
+  }
+  CHECK(open_spdf_wal(doc, log) && doc->wal->skipped == 0);
+  return doc;
+}
+
+/*
+ * Packed adds and removes on both sides of a checkpoint, including enough
+ * removals to free a whole block, must come back from the trimmed log over
+ * the checkpoint, from the full log over it, and from the full log alone.
+ */
+static void test_packed_replay(void) {
+  unlink(spdf_path);
+  unlink(wal_path);
+
+  spdf_t *doc = create_spdf(1);
+  CHECK(doc && open_spdf_wal(doc, wal_path));
+  static spdf_ref_t refs[N_PACKED];
+  for (int i = 0; i < PACKED_SPLIT; i++)
+    CHECK(add_packed_stream(doc, &i, sizeof(i), UTF8, BINARY, &refs[i]));
+  copy_file(wal_path, copy_path, "w");
+  CHECK(checkpoint_spdf(doc, spdf_path));
+
+  for (int i = PACKED_SPLIT; i < N_PACKED; i++)
+    CHECK(add_packed_stream(doc, &i, sizeof(i), UTF8, BINARY, &refs[i]));
+  for (int i = 0; i < N_PACKED; i++)
+    if (!packed_live(i))
+      CHECK(remove_packed_stream(doc, refs[i]));
+  CHECK(doc->blocks[0] == NULL);
+  check_packed(doc, refs);
+
+  // Crash: leave the log open and recover from what is on disk
+  CHECK(sync_spdf_wal(doc->wal, doc->wal->appended_lsn));
+  copy_file(wal_path, copy_path, "a");
+
+  spdf_t *recovered = recover_packed(wal_path, true);
+  check_packed(recovered, refs);
+  destroy_spdf(recovered);
+
+  recovered = recover_packed(copy_path, true);
+  check_packed(recovered, refs);
+  destroy_spdf(recovered);
+
+  recovered = recover_packed(copy_path, false);
+  check_packed(recovered, refs);
+  printf("\npacked: %zu blocks recovered\n", recovered->n_blocks);
+  destroy_spdf(recovered);
+
+  destroy_spdf(doc);
+}
+
+int main(void) {
+  char dir[] = "/tmp/spdf_walXXXXXX";
+  CHECK(mkdtemp(dir));
+  snprintf(wal_path, sizeof(wal_path), "%s/doc.wal", dir);
+  snprintf(spdf_path, sizeof(spdf_path), "%s/doc.spdf", dir);
+  snprintf(copy_path, sizeof(copy_path), "%s/full.wal", dir);
+
+  test_crash_recovery();
+  test_full_replay();
+  test_packed_replay();
+
+  unlink(wal_path);
+  unlink(spdf_path);
+  unlink(copy_path);
+  rmdir(dir);
+  puts("✔️");
+  return EXIT_SUCCESS;
+}